@@ -1,33 +1,655 @@
 #include "acceleration.h"
+#include "cache.h"
 #include "object.h"
 #include "hit.h"
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <tuple>
 
 extern int acceleration_grid_size;
+extern Acceleration_Type acceleration_type;
+extern Hierarchy_Builder hierarchy_builder;
+extern bool single_precision;
+extern bool print_statistics;
+extern bool two_level_acceleration;
+extern bool nested_grid;
+
+// Automatically sized grids get about this many cells per primitive.
+static const double cells_per_primitive=2;
+
+// Cells of the top level grid with more than this many primitives are
+// subdivided when nested grids are enabled.
+static const int subgrid_threshold=32;
 
 Acceleration::Acceleration()
 {
-    domain.Make_Empty();
-    num_cells.fill(acceleration_grid_size);
+    grid.domain.Make_Empty();
+    type=acceleration_type;
+    hierarchy.builder=hierarchy_builder;
+    hierarchy.single_precision=single_precision;
+    nested_grid=::nested_grid;
 }
 
+// Meshes are split into one primitive per triangle so that each triangle is
+// only placed in the cells that it actually touches.  With two-level
+// acceleration, meshes are instead added whole and use their own hierarchy.
 void Acceleration::Add_Object(const Object* obj, int id)
 {
-    TODO;
+    if(obj->Bounding_Box(-1).second)
+    {
+        infinite_objects.push_back({obj,-1,id});
+        return;
+    }
+    if(obj->num_parts==1 || two_level_acceleration)
+    {
+        finite_objects.push_back({obj,-1,id});
+        return;
+    }
+    for(int p=0;p<obj->num_parts;p++)
+        finite_objects.push_back({obj,p,id});
+}
+
+ivec3 Acceleration::Grid::Cell_Index(const vec3& pt) const
+{
+    ivec3 index;
+    for(int i=0;i<3;i++)
+    {
+        int j=(int)std::floor((pt[i]-domain.lo[i])/dx[i]);
+        index[i]=std::max(0,std::min(j,num_cells[i]-1));
+    }
+    return index;
+}
+
+// Choose the number of cells along each axis so that there are about
+// cells_per_primitive*count cells, all roughly cubical.  Axes along which the
+// box is very thin compared to its longest side get a single cell, so flat
+// scenes get a two dimensional grid rather than a few very thin slabs.
+static ivec3 Automatic_Resolution(const Box& box,int count,int max_cells)
+{
+    vec3 size=box.hi-box.lo;
+    double longest=std::max(size[0],std::max(size[1],size[2]));
+    int dimensions=0;
+    double volume=1;
+    for(int i=0;i<3;i++)
+        if(size[i]>1e-3*longest)
+        {
+            dimensions++;
+            volume*=size[i];
+        }
+
+    ivec3 resolution(1,1,1);
+    if(!dimensions) return resolution;
+    double cells=std::min(cells_per_primitive*count,(double)max_cells);
+    double density=std::pow(cells/volume,1.0/dimensions);
+    for(int i=0;i<3;i++)
+        if(size[i]>1e-3*longest)
+            resolution[i]=std::max(1,(int)std::round(size[i]*density));
+    return resolution;
+}
+
+void Acceleration::Grid::Initialize(const Box& box,const ivec3& resolution,
+    const std::vector<Box>& boxes,const std::vector<unsigned>& members,
+    double pad)
+{
+    domain.lo=box.lo-pad;
+    domain.hi=box.hi+pad;
+    num_cells=resolution;
+    if(num_cells[0]<=0 || num_cells[1]<=0 || num_cells[2]<=0)
+        num_cells=Automatic_Resolution(domain,members.size(),1<<24);
+    dx=(domain.hi-domain.lo)/vec3(num_cells);
+
+    // Bin in two passes: count the entries of each cell, then fill them in.
+    std::vector<std::pair<ivec3,ivec3>> ranges(members.size());
+    cell_start.assign(Number_Cells()+1,0);
+    for(size_t m=0;m<members.size();m++)
+    {
+        const Box& b=boxes[members[m]];
+        auto& r=ranges[m];
+        r={Cell_Index(b.lo-pad),Cell_Index(b.hi+pad)};
+        for(int k=r.first[2];k<=r.second[2];k++)
+            for(int j=r.first[1];j<=r.second[1];j++)
+                for(int i=r.first[0];i<=r.second[0];i++)
+                    cell_start[Flat_Index(ivec3(i,j,k))+1]++;
+    }
+    for(size_t c=1;c<cell_start.size();c++)
+        cell_start[c]+=cell_start[c-1];
+
+    std::vector<unsigned> next(cell_start.begin(),cell_start.end()-1);
+    indices.assign(cell_start.back(),0);
+    for(size_t m=0;m<members.size();m++)
+    {
+        const auto& r=ranges[m];
+        for(int k=r.first[2];k<=r.second[2];k++)
+            for(int j=r.first[1];j<=r.second[1];j++)
+                for(int i=r.first[0];i<=r.second[0];i++)
+                    indices[next[Flat_Index(ivec3(i,j,k))]++]=members[m];
+    }
+
+    short_indices.clear();
+    subgrid.clear();
+    if(boxes.size()<=std::numeric_limits<unsigned short>::max()+1u)
+    {
+        short_indices.assign(indices.begin(),indices.end());
+        std::vector<unsigned>().swap(indices);
+    }
+}
+
+// Squeeze out the entries of subdivided cells, which are never visited.
+template<class T> static void Remove_Entries(std::vector<T>& entries,
+    std::vector<unsigned>& cell_start,const std::vector<int>& subgrid)
+{
+    unsigned n=0;
+    for(size_t c=0;c<subgrid.size();c++)
+    {
+        unsigned begin=cell_start[c],end=cell_start[c+1];
+        cell_start[c]=n;
+        if(subgrid[c]<0)
+            for(unsigned e=begin;e<end;e++)
+                entries[n++]=entries[e];
+    }
+    cell_start.back()=n;
+    entries.resize(n);
+    entries.shrink_to_fit();
+}
+
+void Acceleration::Grid::Remove_Subdivided_Cells()
+{
+    if(subgrid.empty()) return;
+    if(indices.empty()) Remove_Entries(short_indices,cell_start,subgrid);
+    else Remove_Entries(indices,cell_start,subgrid);
 }
 
-ivec3 Acceleration::Cell_Index(const vec3& pt) const
+size_t Acceleration::Grid::Memory_Usage() const
 {
-    TODO;
-    return {};
+    return cell_start.size()*sizeof(unsigned)+indices.size()*sizeof(unsigned)
+        +short_indices.size()*sizeof(unsigned short)+subgrid.size()*sizeof(int);
+}
+
+void Acceleration::Grid::Save(Cache_Writer& out) const
+{
+    out.Write(domain);
+    out.Write(num_cells);
+    out.Write(dx);
+    out.Write(cell_start);
+    out.Write(indices);
+    out.Write(short_indices);
+    out.Write(subgrid);
+}
+
+bool Acceleration::Grid::Load(Cache_Reader& in,size_t num_primitives)
+{
+    if(!(in.Read(domain) && in.Read(num_cells) && in.Read(dx) &&
+        in.Read(cell_start) && in.Read(indices) && in.Read(short_indices) &&
+        in.Read(subgrid)))
+        return false;
+
+    long long cells=1;
+    for(int i=0;i<3;i++)
+    {
+        if(num_cells[i]<1 || !(dx[i]>0)) return false;
+        cells*=num_cells[i];
+        if(cells>std::numeric_limits<int>::max()) return false;
+    }
+    size_t entries=indices.empty()?short_indices.size():indices.size();
+    if((!indices.empty() && !short_indices.empty()) ||
+        cell_start.size()!=(size_t)cells+1 || cell_start[0]!=0 ||
+        cell_start.back()!=entries ||
+        (!subgrid.empty() && subgrid.size()!=(size_t)cells))
+        return false;
+    for(int c=0;c<cells;c++)
+        if(cell_start[c]>cell_start[c+1]) return false;
+    for(size_t e=0;e<entries;e++)
+        if(Entry(e)>=num_primitives) return false;
+    for(int s:subgrid)
+        if(s<-1) return false;
+    return true;
+}
+
+// The structures depend only on the bounding boxes of the primitives and
+// the build parameters, so that is what the key is made from.
+uint64_t Acceleration::Cache_Key_Value() const
+{
+    Cache_Key key;
+    key.Add(type);
+    key.Add(hierarchy.builder);
+    key.Add(hierarchy.single_precision);
+    key.Add(nested_grid);
+    key.Add(acceleration_grid_size);
+    key.Add(cells_per_primitive);
+    key.Add(subgrid_threshold);
+    for(const auto& p:finite_objects)
+    {
+        key.Add(p.part);
+        key.Add(p.id);
+        key.Add(p.obj->Bounding_Box(p.part).first);
+    }
+    return key.value;
+}
+
+void Acceleration::Save(Cache_Writer& out) const
+{
+    if(type==hierarchy_acceleration)
+    {
+        hierarchy.Save(out);
+        return;
+    }
+    grid.Save(out);
+    out.Write(subgrids.size());
+    for(const auto& g:subgrids) g.Save(out);
+}
+
+bool Acceleration::Load(Cache_Reader& in)
+{
+    if(type==hierarchy_acceleration)
+    {
+        std::vector<Entry> expected(finite_objects.size());
+        for(size_t i=0;i<finite_objects.size();i++)
+        {
+            const auto& p=finite_objects[i];
+            expected[i]={p.obj,p.part,p.id};
+        }
+        return hierarchy.Load(in,expected);
+    }
+
+    // Only the top level grid is subdivided, and each subgrid belongs to a
+    // cell of it.
+    size_t n=0;
+    if(!grid.Load(in,finite_objects.size()) || !in.Read(n) ||
+        n>(size_t)grid.Number_Cells())
+        return false;
+    for(int s:grid.subgrid)
+        if(s>=(int)n) return false;
+    subgrids.resize(n);
+    for(auto& g:subgrids)
+        if(!g.Load(in,finite_objects.size()) || !g.subgrid.empty()) return false;
+    primitives=finite_objects;
+    return true;
 }
 
 void Acceleration::Initialize()
 {
-    TODO;
+    auto start=std::chrono::steady_clock::now();
+    primitive_ids.resize(finite_objects.size());
+    for(size_t i=0;i<finite_objects.size();i++)
+        primitive_ids[i]=ivec2(finite_objects[i].id,finite_objects[i].part);
+    if(Cache_Enabled())
+    {
+        uint64_t key=Cache_Key_Value();
+        Cache_Reader in("acceleration",key);
+        statistics.cached=Load(in);
+        if(!statistics.cached)
+        {
+            grid=Grid();
+            subgrids.clear();
+            Initialize_Structure();
+            Cache_Writer out("acceleration",key);
+            Save(out);
+        }
+    }
+    else Initialize_Structure();
+
+    finite_objects.clear();
+    finite_objects.shrink_to_fit();
+    statistics.build_time=std::chrono::duration<double>(
+        std::chrono::steady_clock::now()-start).count();
+}
+
+void Acceleration::Initialize(Acceleration& previous)
+{
+    bool same=type==hierarchy_acceleration && previous.type==type &&
+        !previous.hierarchy.Empty() &&
+        previous.primitive_ids.size()==finite_objects.size();
+    for(size_t i=0;same && i<finite_objects.size();i++)
+        same=previous.primitive_ids[i][0]==finite_objects[i].id &&
+            previous.primitive_ids[i][1]==finite_objects[i].part;
+    if(!same)
+    {
+        Initialize();
+        return;
+    }
+
+    auto start=std::chrono::steady_clock::now();
+    primitive_ids=std::move(previous.primitive_ids);
+    hierarchy=std::move(previous.hierarchy);
+    std::vector<const Object*> objects;
+    for(const auto& p:finite_objects)
+    {
+        if(p.id>=(int)objects.size()) objects.resize(p.id+1);
+        objects[p.id]=p.obj;
+    }
+    statistics.changed_primitives=
+        hierarchy.Refit([&objects](int id){return objects[id];});
+    statistics.refit=
+        hierarchy.Cost()<=Hierarchy::rebuild_threshold*hierarchy.build_cost;
+    if(!statistics.refit) Initialize_Hierarchy();
+
+    finite_objects.clear();
+    finite_objects.shrink_to_fit();
+    statistics.build_time=std::chrono::duration<double>(
+        std::chrono::steady_clock::now()-start).count();
+}
+
+void Acceleration::Initialize_Structure()
+{
+    if(type==hierarchy_acceleration) Initialize_Hierarchy();
+    else Initialize_Grid();
+}
+
+void Acceleration::Initialize_Grid()
+{
+    grid.cell_start.clear();
+    subgrids.clear();
+    primitives=finite_objects;
+    if(primitives.empty()) return;
+
+    Box domain;
+    domain.Make_Empty();
+    std::vector<Box> boxes(primitives.size());
+    std::vector<unsigned> members(primitives.size());
+    for(size_t i=0;i<primitives.size();i++)
+    {
+        boxes[i]=primitives[i].obj->Bounding_Box(primitives[i].part).first;
+        domain=domain.Union(boxes[i]);
+        members[i]=i;
+    }
+
+    // Pad the domain slightly so that flat scenes (such as a single triangle)
+    // still have cells of nonzero thickness and so that hits that land just
+    // on the boundary are still inside the grid.
+    vec3 size=domain.hi-domain.lo;
+    double pad=1e-6*std::max(size[0],std::max(size[1],size[2]))+1e-8;
+    ivec3 resolution;
+    resolution.fill(acceleration_grid_size);
+    grid.Initialize(domain,resolution,boxes,members,pad);
+    if(!nested_grid) return;
+
+    // Give each overloaded cell its own automatically sized grid.
+    for(int k=0;k<grid.num_cells[2];k++)
+        for(int j=0;j<grid.num_cells[1];j++)
+            for(int i=0;i<grid.num_cells[0];i++)
+            {
+                ivec3 index(i,j,k);
+                int c=grid.Flat_Index(index);
+                unsigned begin=grid.cell_start[c],end=grid.cell_start[c+1];
+                if((int)(end-begin)<=subgrid_threshold) continue;
+                members.clear();
+                for(unsigned e=begin;e<end;e++)
+                    members.push_back(grid.Entry(e));
+                Box box;
+                box.lo=grid.domain.lo+vec3(index)*grid.dx;
+                box.hi=box.lo+grid.dx;
+                Grid g;
+                g.Initialize(box,ivec3(),boxes,members,pad);
+                if(grid.subgrid.empty())
+                    grid.subgrid.resize(grid.Number_Cells(),-1);
+                grid.subgrid[c]=subgrids.size();
+                subgrids.push_back(std::move(g));
+            }
+    grid.Remove_Subdivided_Cells();
+}
+
+void Acceleration::Initialize_Hierarchy()
+{
+    hierarchy.Clear_Entries(finite_objects.size());
+    for(const auto& p:finite_objects)
+        hierarchy.Add_Entry(p.obj,p.part,p.id);
+    hierarchy.Reorder_Entries();
+    hierarchy.Build_Tree();
+}
+
+// Walk the cells of grid g along the ray using a 3D-DDA, starting no earlier
+// than t_start.  Cells are visited in the order that the ray passes through
+// them, descending into the grids of subdivided cells.  The walk stops once
+// the ray leaves the grid, once the current cell ends beyond t_max, or once
+// visit (called with the index into primitives of each entry in each cell)
+// returns false, in which case false is returned.  Since t_max is a
+// reference, the caller may shrink it during the walk.
+template<class Visit> bool Acceleration::Walk_Grid(const Grid& g,
+    const Ray& ray,double t_start,const double& t_max,long long& steps,
+    Visit visit) const
+{
+    if(g.cell_start.empty()) return true;
+
+    auto [inside,t_enter]=g.domain.Intersection(ray);
+    if(!inside) return true;
+    t_enter=std::max(t_enter,t_start);
+    if(t_max<t_enter) return true;
+
+    ivec3 cell=g.Cell_Index(ray.Point(t_enter)),step;
+    vec3 t_next,t_delta;
+    for(int i=0;i<3;i++)
+    {
+        double d=ray.direction[i];
+        if(d==0)
+        {
+            step[i]=0;
+            t_next[i]=t_delta[i]=std::numeric_limits<double>::infinity();
+            continue;
+        }
+        step[i]=d>0?1:-1;
+        double boundary=g.domain.lo[i]+(cell[i]+(d>0))*g.dx[i];
+        t_next[i]=(boundary-ray.endpoint[i])/d;
+        t_delta[i]=g.dx[i]/std::abs(d);
+    }
+
+    while(true)
+    {
+        steps++;
+        int index=g.Flat_Index(cell);
+        if(!g.subgrid.empty() && g.subgrid[index]>=0)
+        {
+            const Grid& subgrid=subgrids[g.subgrid[index]];
+            if(!Walk_Grid(subgrid,ray,t_enter,t_max,steps,visit))
+                return false;
+        }
+        else
+        {
+            for(unsigned e=g.cell_start[index];e<g.cell_start[index+1];e++)
+                if(!visit(g.Entry(e))) return false;
+        }
+
+        int axis=0;
+        if(t_next[1]<t_next[axis]) axis=1;
+        if(t_next[2]<t_next[axis]) axis=2;
+        if(t_max<=t_next[axis]) return true;
+
+        cell[axis]+=step[axis];
+        if(cell[axis]<0 || cell[axis]>=g.num_cells[axis]) return true;
+        t_enter=t_next[axis];
+        t_next[axis]+=t_delta[axis];
+    }
 }
 
+// A small direct mapped cache of the primitives that have already been tested
+// against the current ray, so that a primitive spanning several cells is only
+// tested once.  Each query keeps its own on the stack, so there is nothing to
+// allocate or share between threads.  Two primitives that map to the same slot
+// evict each other, which costs a repeated test but never a missed one.
+struct Mailbox
+{
+    static const int size=32;
+    unsigned tested[size];
+    long long skipped=0;
+
+    Mailbox()
+    {
+        std::fill(tested,tested+size,~0u);
+    }
+
+    // Return whether primitive was already tested, recording it if not.
+    bool Check(unsigned primitive)
+    {
+        unsigned& slot=tested[primitive%size];
+        if(slot==primitive)
+        {
+            skipped++;
+            return true;
+        }
+        slot=primitive;
+        return false;
+    }
+};
+
 std::pair<int,Hit> Acceleration::Closest_Intersection(const Ray& ray) const
 {
-    TODO;
-    return {};
+    std::pair<int,Hit> closest={-1,{}};
+    closest.second.dist=std::numeric_limits<double>::infinity();
+    long long steps=0,tests=0;
+    Mailbox mailbox;
+
+    auto test=[&ray,&closest,&tests](const Primitive& p)
+    {
+        tests++;
+        Hit hit=p.obj->Intersection(ray,p.part);
+        if(hit.Valid() && hit.dist>=small_t && hit.dist<closest.second.dist)
+            closest={p.id,hit};
+    };
+
+    for(const auto& p:infinite_objects) test(p);
+
+    if(type==hierarchy_acceleration)
+    {
+        auto h=hierarchy.Closest_Intersection(ray,&steps,&tests);
+        if(h.first>=0 && h.second.dist<closest.second.dist)
+            closest={hierarchy.entries[h.first].id,h.second};
+    }
+    else
+    {
+        Walk_Grid(grid,ray,0,closest.second.dist,steps,
+            [this,&test,&mailbox](unsigned i)
+            {
+                if(!mailbox.Check(i)) test(primitives[i]);
+                return true;
+            });
+    }
+
+    if(print_statistics)
+        statistics.closest.Record(steps,tests,1,mailbox.skipped);
+    return closest;
+}
+
+void Acceleration::Closest_Intersection(const Ray_Packet& packet,int mask,
+    int id[],Hit hits[]) const
+{
+    if(type!=hierarchy_acceleration)
+    {
+        for(int k=0;k<packet_size;k++)
+            if(mask&(1<<k))
+                std::tie(id[k],hits[k])=Closest_Intersection(packet.Get_Ray(k));
+        return;
+    }
+
+    long long steps=0,tests=0;
+    for(int k=0;k<packet_size;k++)
+    {
+        if(!(mask&(1<<k))) continue;
+        id[k]=-1;
+        hits[k]=Hit();
+        hits[k].dist=std::numeric_limits<double>::infinity();
+    }
+
+    for(const auto& p:infinite_objects)
+    {
+        Hit object_hits[packet_size];
+        p.obj->Packet_Intersection(packet,p.part,mask,object_hits);
+        for(int k=0;k<packet_size;k++)
+        {
+            if(!(mask&(1<<k))) continue;
+            tests++;
+            const Hit& hit=object_hits[k];
+            if(hit.Valid() && hit.dist>=small_t && hit.dist<hits[k].dist)
+            {
+                id[k]=p.id;
+                hits[k]=hit;
+            }
+        }
+    }
+
+    int entry[packet_size];
+    Hit tree_hits[packet_size];
+    hierarchy.Closest_Intersection(packet,mask,entry,tree_hits,&steps,&tests);
+    for(int k=0;k<packet_size;k++)
+    {
+        if(!(mask&(1<<k)) || entry[k]<0 || tree_hits[k].dist>=hits[k].dist)
+            continue;
+        id[k]=hierarchy.entries[entry[k]].id;
+        hits[k]=tree_hits[k];
+    }
+
+    if(print_statistics)
+        statistics.closest.Record(steps,tests,__builtin_popcount(mask));
+}
+
+bool Acceleration::Any_Intersection(const Ray& ray,double t_max,
+    Occluder* occluder) const
+{
+    long long steps=0,tests=0;
+    bool found=false;
+    Mailbox mailbox;
+
+    auto test=[&ray,t_max,&tests,&found,occluder](const Primitive& p)
+    {
+        tests++;
+        int part=p.part;
+        found=p.obj->Any_Intersection(ray,p.part,t_max,&part);
+        if(found && occluder) *occluder={p.obj,part};
+        return found;
+    };
+
+    for(const auto& p:infinite_objects)
+        if(test(p)) break;
+
+    if(!found && type==hierarchy_acceleration)
+        found=hierarchy.Any_Intersection(ray,t_max,&steps,&tests,occluder);
+    else if(!found)
+    {
+        Walk_Grid(grid,ray,0,t_max,steps,
+            [this,&test,&mailbox](unsigned i)
+            {
+                return mailbox.Check(i) || !test(primitives[i]);
+            });
+    }
+
+    if(print_statistics)
+        statistics.occlusion.Record(steps,tests,1,mailbox.skipped);
+    return found;
+}
+
+static void Print_Traversal(std::ostream& out,const char* label,
+    const Traversal_Statistics& s)
+{
+    out<<"; "<<label<<" rays: "<<s.rays;
+    if(s.rays)
+        out<<" (steps/ray: "<<(double)s.traversal_steps/s.rays
+           <<"; tests/ray: "<<(double)s.primitive_tests/s.rays
+           <<"; repeated tests skipped/ray: "<<(double)s.mailbox_skips/s.rays
+           <<")";
+}
+
+void Acceleration::Print_Statistics(std::ostream& out) const
+{
+    out<<"acceleration: ";
+    if(type==grid_acceleration)
+    {
+        out<<"grid "<<grid.num_cells[0]<<"x"<<grid.num_cells[1]<<"x"
+           <<grid.num_cells[2];
+        size_t memory=grid.Memory_Usage();
+        for(const auto& g:subgrids) memory+=g.Memory_Usage();
+        if(nested_grid) out<<" with "<<subgrids.size()<<" subgrids";
+        out<<"; cell storage: "<<memory/1024<<" KiB";
+    }
+    else
+        out<<"hierarchy ("<<(hierarchy.builder==morton_builder?"morton":"sah")
+           <<(hierarchy.single_precision?", single precision":"")
+           <<"; cost: "<<hierarchy.Cost()<<"; storage: "
+           <<hierarchy.Memory_Usage()/1024<<" KiB)";
+    out<<"; build time: "<<statistics.build_time*1000<<" ms";
+    if(statistics.cached) out<<" (loaded from cache)";
+    if(statistics.refit)
+        out<<" (refitted; "<<statistics.changed_primitives
+           <<" primitives moved)";
+    Print_Traversal(out,"closest",statistics.closest);
+    Print_Traversal(out,"occlusion",statistics.occlusion);
+    out<<std::endl;
 }
@@ -3,12 +3,52 @@
 
 #include "box.h"
 #include "hit.h"
+#include "hierarchy.h"
 #include "vec.h"
 #include "misc.h"
+#include <atomic>
 #include <iosfwd>
 #include <vector>
 
 class Object;
+class Cache_Reader;
+class Cache_Writer;
+
+// Which structure Acceleration builds.  This is selected with the -a
+// commandline option through the global variable acceleration_type.
+enum Acceleration_Type {grid_acceleration, hierarchy_acceleration};
+
+// Counters reported with the -v commandline option.  Traversal steps are grid
+// cells visited for the grid and tree nodes visited for the hierarchy.
+// Mailbox skips are tests of a primitive that the grid avoided because the
+// same ray had already tested it in an earlier cell.
+// Rays are traced from several threads at once, so the counters are atomic.
+// They are only updated when statistics are printed (-v).
+struct Traversal_Statistics
+{
+    std::atomic<long long> rays{0};
+    std::atomic<long long> traversal_steps{0};
+    std::atomic<long long> primitive_tests{0};
+    std::atomic<long long> mailbox_skips{0};
+
+    void Record(long long steps,long long tests,int count=1,long long skips=0)
+    {
+        rays.fetch_add(count,std::memory_order_relaxed);
+        traversal_steps.fetch_add(steps,std::memory_order_relaxed);
+        primitive_tests.fetch_add(tests,std::memory_order_relaxed);
+        mailbox_skips.fetch_add(skips,std::memory_order_relaxed);
+    }
+};
+
+struct Acceleration_Statistics
+{
+    double build_time=0;
+    bool cached=false; // loaded from the cache (-c) instead of built
+    bool refit=false; // refitted from the previous frame (-n) instead of built
+    int changed_primitives=0; // primitives whose boxes changed when refitting
+    Traversal_Statistics closest; // Closest_Intersection queries
+    Traversal_Statistics occlusion; // Any_Intersection queries
+};
 
 class Acceleration
 {
@@ -23,8 +63,8 @@ class Acceleration
 
     // Holding area for objects that are finite in size, before Initialize() is
     // called.  The acceleration structures cannot be constructed until all
-    // objects are known because the full bounding box (member domain below) is
-    // required to initialize the acceleration structures.
+    // objects are known because the full bounding box (member grid.domain
+    // below) is required to initialize the acceleration structures.
     std::vector<Primitive> finite_objects;
 
     // This list holds infinite objects.  These are not placed in the
@@ -33,28 +73,105 @@ class Acceleration
     // and detect intersections with them separately.
     std::vector<Primitive> infinite_objects;
 
-    // This is the grid storage area.  The outer std::vector is an array of
-    // cells (as a flat array, rather like how we do pixels as a flat array).
-    // The Flat_Index(...) function below can convert from a cell index (ivec3)
-    // to an index into this std::vector.  You will mostly access this using the
-    // Cell_Data(...) routines below.  The inner std::vector is a list of
-    // primitives whose bounding boxes touch the cell.  This member is allocated
-    // and populated by the Initialize() routine.
-    std::vector<std::vector<Primitive>> cells;
-
-    // This is the number of cells in the grid's acceleration structure.  By
-    // default, this will be (40,40,40), which indicates a 40x40x40 grid, in
-    // which case cells will have 64000 entries.  This can be changed with the
-    // -z commandline option through the global variable acceleration_grid_size.
-    // Changing this value is very useful for testing and debugging.
-    ivec3 num_cells;
-
-    // This is the size of each grid cell.  Note that the cells might not be
-    // cubes; the sides may have different lengths.
-    vec3 dx;
-
-    // This is the bounding box of all of the finite objects.
-    Box domain;
+    // A uniform grid over a box.  The acceleration structure is a single top
+    // level grid.  Cells of the top level grid that end up with too many
+    // primitives may be subdivided by a grid of their own (see subgrids).
+    struct Grid
+    {
+        // This is the grid storage area, in compressed sparse row form.  The
+        // primitives whose bounding boxes touch cell c are
+        // primitives[Entry(e)] for cell_start[c] <= e < cell_start[c+1], where
+        // cells are numbered by Flat_Index(...) below.  The entries are
+        // stored as 16 bit indices in short_indices when there are few
+        // enough primitives and as 32 bit indices in indices otherwise; only
+        // one of the two is used.
+        std::vector<unsigned> cell_start;
+        std::vector<unsigned> indices;
+        std::vector<unsigned short> short_indices;
+
+        // For each cell, the index into subgrids of the grid that subdivides
+        // it, or -1.  This is empty if no cell is subdivided.
+        std::vector<int> subgrid;
+
+        // This is the number of cells in the grid.  By default this is chosen
+        // from the number of primitives and the shape of the domain.  For the
+        // top level grid it can be set with the -z commandline option through
+        // the global variable acceleration_grid_size.  Changing this value is
+        // very useful for testing and debugging.
+        ivec3 num_cells;
+
+        // This is the size of each grid cell.  Note that the cells might not
+        // be cubes; the sides may have different lengths.
+        vec3 dx;
+
+        // This is the box covered by the grid.  For the top level grid, it is
+        // the bounding box of all of the finite objects.
+        Box domain;
+
+        // Given a location in space, identify the grid cell that contains it.
+        ivec3 Cell_Index(const vec3& pt) const;
+
+        // Given a grid index, compute the flattened index.
+        int Flat_Index(const ivec3& i) const
+        {
+            return (i[2]*num_cells[1]+i[1])*num_cells[0]+i[0];
+        }
+
+        int Number_Cells() const
+        {
+            return num_cells[0]*num_cells[1]*num_cells[2];
+        }
+
+        // The index into primitives of the entry e (see cell_start).
+        unsigned Entry(unsigned e) const
+        {
+            return indices.empty()?short_indices[e]:indices[e];
+        }
+
+        // Set domain, num_cells and dx and bin the primitives listed in
+        // members into cells; boxes holds the bounding box of each primitive.
+        // If resolution has any entry <= 0, a resolution is chosen
+        // automatically.  The domain and the primitive boxes are enlarged by
+        // pad.
+        void Initialize(const Box& box,const ivec3& resolution,
+            const std::vector<Box>& boxes,const std::vector<unsigned>& members,
+            double pad);
+
+        // Drop the entries of the cells that have been subdivided.
+        void Remove_Subdivided_Cells();
+
+        // Bytes used by the cell storage.
+        size_t Memory_Usage() const;
+
+        // Load returns false if the data is missing or damaged, including
+        // entries that are not below num_primitives.  The subgrid values are
+        // checked by Acceleration::Load, which knows how many there are.
+        void Save(Cache_Writer& out) const;
+        bool Load(Cache_Reader& in,size_t num_primitives);
+    };
+
+    // The primitives referenced by the grids.
+    std::vector<Primitive> primitives;
+
+    Grid grid;
+    std::vector<Grid> subgrids;
+
+    // Whether overloaded cells of the top level grid are subdivided.
+    bool nested_grid;
+
+    // The structure that Initialize() builds and Closest_Intersection() uses.
+    Acceleration_Type type;
+
+    // When type is hierarchy_acceleration, the finite objects are stored here
+    // instead of in the grids.
+    Hierarchy hierarchy;
+
+    // The (id,part) of each finite primitive in the order that they were
+    // added.  A frame can reuse the previous frame's hierarchy only if these
+    // match.
+    std::vector<ivec2> primitive_ids;
+
+    mutable Acceleration_Statistics statistics;
 
 public:
     Acceleration();
@@ -68,13 +185,23 @@ public:
     void Add_Object(const Object* obj, int id);
 
     // This is called after all objects have been added with Add_Object.  This
-    // routine most do a few things.  (1) Allocate the cells array to the
+    // routine most do a few things.  (1) Allocate the cell storage to the
     // appropriate size. (2) Ensure that domain and dx have been computed.  (3)
-    // Populate the cells array with the appropriate primitives.  (4) After this
-    // routine has been called, finite_objects is no longer needed and can be
-    // cleared.
+    // Populate the cell storage with the appropriate primitives.  (4) Subdivide
+    // overloaded cells if nested grids are enabled.  (5) After this routine
+    // has been called, finite_objects is no longer needed and can be cleared.
     void Initialize();
 
+    // Used instead of Initialize() for the frames after the first in a frame
+    // sequence (-n), where previous is the structure used for the previous
+    // frame.  If this frame has the same primitives (only their positions or
+    // sizes differ), the previous hierarchy is taken over and refitted to
+    // the new bounding boxes, which is much cheaper than a rebuild.  The
+    // hierarchy is rebuilt from scratch once refitting has made its Cost()
+    // grow by more than the factor rebuild_threshold since it was built.
+    // Otherwise this is the same as Initialize().
+    void Initialize(Acceleration& previous);
+
     // This routine mirrors the corresponding routine in Render_World, though
     // the return value is a bit different.  The integer is the id for the
     // intersected object (the id that was passed to Add_Object when the object
@@ -84,26 +211,33 @@ public:
     // acceleration structure along the ray to identify intersections, returning
     // the closest.  Don't forget to check the infinite_objects.
     std::pair<int,Hit> Closest_Intersection(const Ray& ray) const;
-private:
 
-    // Given a location in space, identify the grid cell that contains it.
-    ivec3 Cell_Index(const vec3& pt) const;
+    // Packet version of Closest_Intersection for the rays whose bits are set
+    // in mask.  Only the hierarchy traces packets; the grid traces the rays
+    // one at a time.
+    void Closest_Intersection(const Ray_Packet& packet,int mask,int id[],
+        Hit hits[]) const;
 
-    // Given a grid index, compute the flattened index.
-    int Flat_Index(const ivec3& i) const
-    {
-        return (i[2]*num_cells[1]+i[1])*num_cells[0]+i[0];
-    }
+    // Return whether anything is intersected in the range [small_t,t_max).
+    // This mirrors Render_World::Any_Intersection and is used for shadow rays.
+    // It returns as soon as any blocker is found, which is stored in occluder
+    // if that is not null.
+    bool Any_Intersection(const Ray& ray,double t_max,
+        Occluder* occluder=nullptr) const;
 
-    // Given a grid index, return the primitive list for the cell.
-    std::vector<Primitive>& Cell_Data(const ivec3& i)
-    {
-        return cells[Flat_Index(i)];
-    }
-    const std::vector<Primitive>& Cell_Data(const ivec3& i) const
-    {
-        return cells[Flat_Index(i)];
-    }
+    void Print_Statistics(std::ostream& out) const;
+private:
+    // With caching enabled (-c), Initialize() first tries to load the
+    // structure from the cache, and saves it there after building it.
+    uint64_t Cache_Key_Value() const;
+    void Save(Cache_Writer& out) const;
+    bool Load(Cache_Reader& in);
+
+    void Initialize_Structure();
+    void Initialize_Grid();
+    void Initialize_Hierarchy();
+    template<class Visit> bool Walk_Grid(const Grid& g,const Ray& ray,
+        double t_start,const double& t_max,long long& steps,Visit visit) const;
 };
 
 #endif
@@ -1,18 +1,138 @@
+#include <cmath>
 #include <limits>
 #include "box.h"
 
-// Return whether the ray intersects this box.
+// Return whether the ray intersects this box.  The second value is the
+// distance along the ray at which the ray enters the box.  It is negative if
+// the endpoint of the ray is already inside the box.
 std::pair<bool,double> Box::Intersection(const Ray& ray) const
 {
-    TODO;
-    return {true,0};
+    return Intersection(Precomputed_Ray(ray));
+}
+
+// The slab tests are written once for both Box and Float_Box (B below).
+
+// The sign of the direction picks which side of each slab is near, so there
+// is no swap.  A slab bound is NaN only when a ray lies exactly on a slab
+// plane and is parallel to it (0*inf).  Such a slab does not constrain the
+// ray, and the comparisons below are written so that NaN bounds are ignored.
+template<class B> static std::pair<bool,double> Slab_Test(const B& box,
+    const Precomputed_Ray& ray,double t_max)
+{
+    double t_enter=-std::numeric_limits<double>::infinity();
+    double t_exit=t_max;
+    for(int i=0;i<3;i++)
+    {
+        double near=((ray.sign[i]?box.hi:box.lo)[i]-ray.endpoint[i])*ray.inverse_direction[i];
+        double far=((ray.sign[i]?box.lo:box.hi)[i]-ray.endpoint[i])*ray.inverse_direction[i];
+        t_enter=near>t_enter?near:t_enter;
+        t_exit=far<t_exit?far:t_exit;
+    }
+    return {t_enter<=t_exit && t_exit>=0,t_enter};
+}
+
+template<class B> static int Slab_Test(const B* boxes,
+    const Precomputed_Ray& ray,double t_max,double4& t_enter)
+{
+    t_enter=Splat(-std::numeric_limits<double>::infinity());
+    double4 t_exit=Splat(t_max);
+    for(int i=0;i<3;i++)
+    {
+        double4 near,far;
+        for(int k=0;k<packet_size;k++)
+        {
+            near[k]=(ray.sign[i]?boxes[k].hi:boxes[k].lo)[i];
+            far[k]=(ray.sign[i]?boxes[k].lo:boxes[k].hi)[i];
+        }
+        near=(near-ray.endpoint[i])*ray.inverse_direction[i];
+        far=(far-ray.endpoint[i])*ray.inverse_direction[i];
+        t_enter=near>t_enter?near:t_enter;
+        t_exit=far<t_exit?far:t_exit;
+    }
+    return Lane_Mask((t_enter<=t_exit)&(t_exit>=0));
+}
+
+// Packets may mix directions, so this orders the bounds of each slab with
+// comparisons instead.  NaN bounds are replaced with -inf for the entry
+// distance and +inf for the exit distance.
+template<class B> static int Slab_Test(const B& box,const Ray_Packet& packet,
+    const double4& t_max)
+{
+    const double4 inf=Splat(std::numeric_limits<double>::infinity());
+    double4 t_enter=-inf,t_exit=t_max;
+    for(int i=0;i<3;i++)
+    {
+        double4 a=((double)box.lo[i]-packet.endpoint[i])*packet.inverse_direction[i];
+        double4 b=((double)box.hi[i]-packet.endpoint[i])*packet.inverse_direction[i];
+        double4 a_lo=a==a?a:-inf,b_lo=b==b?b:-inf;
+        double4 a_hi=a==a?a:inf,b_hi=b==b?b:inf;
+        double4 near=a_lo<b_lo?a_lo:b_lo;
+        double4 far=a_hi>b_hi?a_hi:b_hi;
+        t_enter=near>t_enter?near:t_enter;
+        t_exit=far<t_exit?far:t_exit;
+    }
+    return Lane_Mask((t_enter<=t_exit)&(t_exit>=0));
+}
+
+std::pair<bool,double> Box::Intersection(const Precomputed_Ray& ray,
+    double t_max) const
+{
+    return Slab_Test(*this,ray,t_max);
+}
+
+int Box::Intersection(const Precomputed_Ray& ray,const Box* boxes,
+    double t_max,double4& t_enter)
+{
+    return Slab_Test(boxes,ray,t_max,t_enter);
+}
+
+int Box::Intersection(const Ray_Packet& packet,const double4& t_max) const
+{
+    return Slab_Test(*this,packet,t_max);
+}
+
+std::pair<bool,double> Float_Box::Intersection(const Precomputed_Ray& ray,
+    double t_max) const
+{
+    return Slab_Test(*this,ray,t_max);
+}
+
+int Float_Box::Intersection(const Precomputed_Ray& ray,const Float_Box* boxes,
+    double t_max,double4& t_enter)
+{
+    return Slab_Test(boxes,ray,t_max,t_enter);
+}
+
+int Float_Box::Intersection(const Ray_Packet& packet,const double4& t_max) const
+{
+    return Slab_Test(*this,packet,t_max);
+}
+
+// Round each corner outward to the nearest float, so that the float box
+// contains the original box.
+Float_Box::Float_Box(const Box& b)
+{
+    const float inf=std::numeric_limits<float>::infinity();
+    for(int i=0;i<3;i++)
+    {
+        lo[i]=(float)b.lo[i];
+        if(lo[i]>b.lo[i]) lo[i]=std::nextafter(lo[i],-inf);
+        hi[i]=(float)b.hi[i];
+        if(hi[i]<b.hi[i]) hi[i]=std::nextafter(hi[i],inf);
+    }
+}
+
+Box Float_Box::To_Box() const
+{
+    return {vec3(lo),vec3(hi)};
 }
 
 // Compute the smallest box that contains both *this and bb.
 Box Box::Union(const Box& bb) const
 {
     Box box;
-    TODO;
+    box.lo=componentwise_min(lo,bb.lo);
+    box.hi=componentwise_max(hi,bb.hi);
     return box;
 }
 
@@ -20,14 +140,16 @@ Box Box::Union(const Box& bb) const
 Box Box::Intersection(const Box& bb) const
 {
     Box box;
-    TODO;
+    box.lo=componentwise_max(lo,bb.lo);
+    box.hi=componentwise_min(hi,bb.hi);
     return box;
 }
 
 // Enlarge this box (if necessary) so that pt also lies inside it.
 void Box::Include_Point(const vec3& pt)
 {
-    TODO;
+    lo=componentwise_min(lo,pt);
+    hi=componentwise_max(hi,pt);
 }
 
 // Create a box to which points can be correctly added using Include_Point.
@@ -44,6 +166,15 @@ void Box::Make_Full()
     lo=-hi;
 }
 
+bool Box::Is_Full() const
+{
+    for(int i=0;i<3;i++)
+        if(lo[i]!=-std::numeric_limits<double>::infinity() ||
+            hi[i]!=std::numeric_limits<double>::infinity())
+            return false;
+    return true;
+}
+
 bool Box::Test_Inside(const vec3& pt) const
 {
     for(int i=0;i<3;i++)
@@ -2,6 +2,7 @@
 #define __BOX_H__
 
 #include "ray.h"
+#include "ray_packet.h"
 #include "misc.h"
 #include <limits>
 
@@ -14,6 +15,21 @@ public:
     // Return whether the ray intersects this box.
     std::pair<bool,double> Intersection(const Ray& ray) const;
 
+    // Same, using precomputed ray data, for rays that enter the box no later
+    // than t_max.  This is the version to use when testing many boxes.
+    std::pair<bool,double> Intersection(const Precomputed_Ray& ray,
+        double t_max=std::numeric_limits<double>::infinity()) const;
+
+    // Test one ray against the four consecutive boxes boxes[0..3].  Return a
+    // mask with bit k set if the ray enters boxes[k] no later than t_max, and
+    // set lane k of t_enter to the entry distance.
+    static int Intersection(const Precomputed_Ray& ray,const Box* boxes,
+        double t_max,double4& t_enter);
+
+    // Packet version.  Return a mask of the rays in the packet that enter the
+    // box before t_max (one value per ray).
+    int Intersection(const Ray_Packet& packet,const double4& t_max) const;
+
     // Compute the smallest box that contains both *this and bb.
     Box Union(const Box& bb) const;
 
@@ -35,6 +51,28 @@ public:
     bool Test_Inside(const vec3& pt) const;
 };
 
+// A box stored in single precision, for large numbers of boxes.  Converting
+// from a Box rounds outward, so the Float_Box contains the original box and
+// a ray that hits the original always hits it.  The intersection routines
+// are the same as those of Box and work in double precision.
+class Float_Box
+{
+public:
+    fvec3 lo,hi;
+
+    Float_Box() = default;
+    explicit Float_Box(const Box& b);
+
+    // The same box in double precision (exactly).
+    Box To_Box() const;
+
+    std::pair<bool,double> Intersection(const Precomputed_Ray& ray,
+        double t_max=std::numeric_limits<double>::infinity()) const;
+    static int Intersection(const Precomputed_Ray& ray,const Float_Box* boxes,
+        double t_max,double4& t_enter);
+    int Intersection(const Ray_Packet& packet,const double4& t_max) const;
+};
+
 // Useful for debugging
 std::ostream& operator<<(std::ostream& o, const Box& b);
 
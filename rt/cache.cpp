@@ -0,0 +1,119 @@
+#include "cache.h"
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern const char* cache_directory;
+
+static const char cache_magic[8]={'R','T','C','A','C','H','E','\n'};
+
+struct Cache_Header
+{
+    char magic[8];
+    uint32_t version;
+    char kind[20];
+    uint64_t key;
+};
+
+static Cache_Header Make_Header(const char* kind,uint64_t key)
+{
+    Cache_Header header;
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,cache_magic,sizeof(cache_magic));
+    header.version=cache_version;
+    strncpy(header.kind,kind,sizeof(header.kind)-1);
+    header.key=key;
+    return header;
+}
+
+static std::string Cache_Path(const char* kind,uint64_t key)
+{
+    char name[64];
+    snprintf(name,sizeof(name),"/%s-%016llx.cache",kind,(unsigned long long)key);
+    return cache_directory+std::string(name);
+}
+
+bool Cache_Enabled()
+{
+    return cache_directory!=nullptr;
+}
+
+// FNV-1a, taking eight bytes at a time where possible.
+void Cache_Key::Add(const void* data,size_t size)
+{
+    const uint64_t prime=0x100000001b3ull;
+    const char* p=(const char*)data;
+    for(;size>=8;p+=8,size-=8)
+    {
+        uint64_t word;
+        memcpy(&word,p,8);
+        value=(value^word)*prime;
+    }
+    for(;size>0;p++,size--)
+        value=(value^(unsigned char)*p)*prime;
+}
+
+Cache_Writer::Cache_Writer(const char* kind,uint64_t key)
+{
+    if(!Cache_Enabled()) return;
+    path=Cache_Path(kind,key);
+    temporary_path=path+"."+std::to_string(getpid());
+    file=fopen(temporary_path.c_str(),"wb");
+    if(!file) return;
+    Write(Make_Header(kind,key));
+}
+
+Cache_Writer::~Cache_Writer()
+{
+    if(!file) return;
+    if(fclose(file)==0) rename(temporary_path.c_str(),path.c_str());
+    else unlink(temporary_path.c_str());
+}
+
+void Cache_Writer::Write(const void* data,size_t size)
+{
+    if(!file) return;
+    if(fwrite(data,1,size,file)!=size)
+    {
+        fclose(file);
+        unlink(temporary_path.c_str());
+        file=nullptr;
+    }
+}
+
+Cache_Reader::Cache_Reader(const char* kind,uint64_t key)
+{
+    if(!Cache_Enabled()) return;
+    int fd=open(Cache_Path(kind,key).c_str(),O_RDONLY);
+    if(fd<0) return;
+    struct stat st;
+    if(fstat(fd,&st)==0 && st.st_size>=(off_t)sizeof(Cache_Header))
+    {
+        void* p=mmap(nullptr,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+        if(p!=MAP_FAILED)
+        {
+            data=(const char*)p;
+            size=st.st_size;
+        }
+    }
+    close(fd);
+
+    Cache_Header header,expected=Make_Header(kind,key);
+    if(data && !(Read(header) && !memcmp(&header,&expected,sizeof(header))))
+        position=size;
+}
+
+Cache_Reader::~Cache_Reader()
+{
+    if(data) munmap((void*)data,size);
+}
+
+bool Cache_Reader::Read(void* x,size_t n)
+{
+    if(n>size-position) return false;
+    memcpy(x,data+position,n);
+    position+=n;
+    return true;
+}
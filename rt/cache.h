@@ -0,0 +1,113 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/*
+  Parsed meshes and built acceleration structures can be saved to a cache
+  directory (the -c commandline option) so that later runs over the same
+  scene skip that work.  Each cache file is named after its kind (such as
+  "mesh") and a 64 bit key, which is a hash of everything that the data was
+  built from: file contents, bounding boxes and build parameters.  A file
+  starts with a header holding a magic number, the format version, the kind
+  and the key, and a file whose header does not match is ignored and rebuilt.
+  Bump cache_version whenever the layout of any cached data changes.
+
+  Files are written under a temporary name and renamed into place when they
+  are complete, so several ray tracers sharing a cache directory never see a
+  partial file.  Files are read through mmap.
+
+  The data is stored in the native byte order and layout, so a cache
+  directory should not be shared between different machines.
+*/
+
+static const uint32_t cache_version=3;
+
+// Return whether a cache directory was given.
+bool Cache_Enabled();
+
+// Hash of the data that a cached item is built from.
+class Cache_Key
+{
+public:
+    uint64_t value=0xcbf29ce484222325ull;
+
+    void Add(const void* data,size_t size);
+
+    template<class T> void Add(const T& x)
+    {
+        static_assert(std::is_trivially_copyable<T>::value,"cannot hash type");
+        Add(&x,sizeof(x));
+    }
+
+    template<class T> void Add(const std::vector<T>& v)
+    {
+        Add(v.size());
+        Add(v.data(),v.size()*sizeof(T));
+    }
+
+    void Add(const std::string& s)
+    {
+        Add(s.size());
+        Add(s.data(),s.size());
+    }
+};
+
+// Writes a cache file.  Nothing is written if caching is disabled or the
+// file cannot be created.  The file is put in place by the destructor.
+class Cache_Writer
+{
+    std::string path,temporary_path;
+    FILE* file=nullptr;
+public:
+    Cache_Writer(const char* kind,uint64_t key);
+    ~Cache_Writer();
+
+    void Write(const void* data,size_t size);
+
+    template<class T> void Write(const T& x)
+    {
+        static_assert(std::is_trivially_copyable<T>::value,"cannot cache type");
+        Write(&x,sizeof(x));
+    }
+
+    template<class T> void Write(const std::vector<T>& v)
+    {
+        Write(v.size());
+        Write(v.data(),v.size()*sizeof(T));
+    }
+};
+
+// Reads a cache file.  Every Read fails (returning false) if caching is
+// disabled, the file does not exist or its header does not match, or the
+// file ends early.
+class Cache_Reader
+{
+    const char* data=nullptr;
+    size_t size=0,position=0;
+public:
+    Cache_Reader(const char* kind,uint64_t key);
+    ~Cache_Reader();
+
+    bool Read(void* x,size_t n);
+
+    template<class T> bool Read(T& x)
+    {
+        static_assert(std::is_trivially_copyable<T>::value,"cannot cache type");
+        return Read(&x,sizeof(x));
+    }
+
+    template<class T> bool Read(std::vector<T>& v)
+    {
+        size_t n;
+        if(!Read(n) || n>(size-position)/sizeof(T)) return false;
+        v.resize(n);
+        return Read(v.data(),n*sizeof(T));
+    }
+};
+
+#endif
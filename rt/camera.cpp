@@ -42,9 +42,7 @@ void Camera::Set_Resolution(const ivec2& number_pixels_input)
 vec3 Camera::World_Position(const ivec2& pixel_index)
 {
     vec2 pixel_center = Cell_Center(pixel_index);
-    vec3 world_position = film_position 
-                        + pixel_center[0] * horizontal_vector
-                        + pixel_center[1] * vertical_vector;
+    vec3 world_position = World_Position(pixel_center);
 
     // std::cout << "Generated ray for pixel (" << pixel_index[0] << ", " 
     //           << pixel_index[1] << "): " << world_position << std::endl;
@@ -52,3 +50,12 @@ vec3 Camera::World_Position(const ivec2& pixel_index)
     return world_position;
 }
 
+// Find the world position of a point on the film, in the coordinates of min
+// and max
+vec3 Camera::World_Position(const vec2& film_point) const
+{
+    return film_position
+        + film_point[0] * horizontal_vector
+        + film_point[1] * vertical_vector;
+}
+
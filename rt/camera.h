@@ -36,6 +36,7 @@ public:
 
     // Used for determining the where pixels are
     vec3 World_Position(const ivec2& pixel_index);
+    vec3 World_Position(const vec2& film_point) const;
     vec2 Cell_Center(const ivec2& index) const
     {
         return min+(vec2(index)+vec2(.5,.5))*pixel_size;
@@ -48,5 +49,10 @@ public:
         int j=pixel_index[1];
         colors[j*number_pixels[0]+i]=color;
     }
+
+    Pixel Get_Pixel(const ivec2& pixel_index) const
+    {
+        return colors[pixel_index[1]*number_pixels[0]+pixel_index[0]];
+    }
 };
 #endif
@@ -10,6 +10,13 @@ public:
 
     virtual ~Color()=default;
     virtual vec3 Get_Color(const vec2& uv) const=0;
+
+    // Look up the colors at n texture coordinates at once.  This is
+    // overridden by colors that can do so without a call per point.
+    virtual void Get_Colors(const vec2 uv[],int n,vec3 colors[]) const
+    {
+        for(int i=0;i<n;i++) colors[i]=Get_Color(uv[i]);
+    }
 };
 
 
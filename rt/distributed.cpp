@@ -0,0 +1,478 @@
+#include "render_world.h"
+#include "cache.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern bool print_statistics;
+extern bool single_precision;
+extern double minimum_throughput;
+extern bool russian_roulette;
+extern double light_cutoff;
+
+/*
+  Distributed rendering (the --coordinator and --worker commandline options).
+  The coordinator splits the image into jobs of one row of tiles each and
+  hands them out to the workers that connect to it.  Each worker parses the
+  scene itself, renders the tiles of each job it is given with
+  Render_World::Render_Tiles, and sends back their pixels, which the
+  coordinator copies into Camera::colors.  Every pixel is computed
+  independently of all others, so the image is the same as a local render.
+
+  The messages are sent in the byte order of the machine, so all processes
+  must run the same build:
+
+  worker -> coordinator: magic, scene key         (uint32, uint64)
+  coordinator -> worker: job, or -1 when done     (int32)
+  worker -> coordinator: job, pixels of its rows  (int32, Pixel[width*rows])
+
+  The scene key is a hash of the parsed scene, including the contents of
+  mesh files, and of the options that change the image, and workers whose
+  key differs from the coordinator's are turned away.  Each worker is given
+  two jobs at a time, so that it has the next one at hand when it sends back
+  the last.
+
+  A worker that disconnects, by crashing or being killed, loses its jobs to
+  the other workers.  A worker can also stop answering without
+  disconnecting, if it hangs or is stopped or its node is cut off, so once
+  every job has been handed out, idle workers are given copies of the jobs
+  that are still out, fewest copies first.  Whichever copy comes back first
+  is used.  TCP keepalives close connections to unreachable nodes.
+*/
+
+static const uint32_t worker_magic=0x31575452; // "RTW1"
+static const int jobs_per_worker=2;
+
+// Probe an idle TCP connection after this many seconds, and give up after
+// keepalive_probes unanswered probes this many seconds apart.
+static const int keepalive_idle=10;
+static const int keepalive_interval=5;
+static const int keepalive_probes=3;
+
+static void Keep_Alive(int fd,int family)
+{
+    int one=1;
+    setsockopt(fd,SOL_SOCKET,SO_KEEPALIVE,&one,sizeof(one));
+    if(family==AF_UNIX) return;
+    setsockopt(fd,IPPROTO_TCP,TCP_KEEPIDLE,&keepalive_idle,sizeof(keepalive_idle));
+    setsockopt(fd,IPPROTO_TCP,TCP_KEEPINTVL,&keepalive_interval,sizeof(keepalive_interval));
+    setsockopt(fd,IPPROTO_TCP,TCP_KEEPCNT,&keepalive_probes,sizeof(keepalive_probes));
+}
+
+// Hash of what decides the pixels of a scene
+static uint64_t Scene_Key(const Render_World& render_world)
+{
+    Cache_Key key=render_world.geometry_key;
+    key.Add(render_world.settings_key.value);
+    for(const auto& s:render_world.shader_keys)
+    {
+        key.Add(s.first);
+        key.Add(s.second);
+    }
+    for(uint64_t l:render_world.light_keys) key.Add(l);
+    key.Add(single_precision);
+    key.Add(minimum_throughput);
+    key.Add(russian_roulette);
+    key.Add(light_cutoff);
+    return key.value;
+}
+
+// An address is either a path of a Unix domain socket, written with a
+// leading "unix:" or containing a '/', or host:port for TCP.  An empty host
+// listens on every interface.
+struct Socket_Address
+{
+    sockaddr_storage address;
+    socklen_t length=0;
+    int family=AF_UNIX;
+    std::string path; // of a Unix domain socket
+};
+
+static Socket_Address Resolve(const char* text,bool listening)
+{
+    Socket_Address result;
+    std::string s(text);
+    if(!s.compare(0,5,"unix:") || s.find('/')!=std::string::npos)
+    {
+        result.path=s.compare(0,5,"unix:")?s:s.substr(5);
+        sockaddr_un* un=(sockaddr_un*)&result.address;
+        memset(un,0,sizeof(*un));
+        un->sun_family=AF_UNIX;
+        if(result.path.size()>=sizeof(un->sun_path))
+        {
+            std::cerr<<"Error: socket path too long: "<<result.path<<std::endl;
+            exit(1);
+        }
+        strcpy(un->sun_path,result.path.c_str());
+        result.length=sizeof(*un);
+        return result;
+    }
+
+    std::string::size_type colon=s.rfind(':');
+    if(colon==std::string::npos)
+    {
+        std::cerr<<"Error: expected host:port or a socket path: "<<text<<std::endl;
+        exit(1);
+    }
+    std::string host=s.substr(0,colon),port=s.substr(colon+1);
+    addrinfo hints={},*info=nullptr;
+    hints.ai_family=AF_UNSPEC;
+    hints.ai_socktype=SOCK_STREAM;
+    if(listening) hints.ai_flags=AI_PASSIVE;
+    if(int error=getaddrinfo(host.empty()?nullptr:host.c_str(),port.c_str(),&hints,&info))
+    {
+        std::cerr<<"Error: "<<text<<": "<<gai_strerror(error)<<std::endl;
+        exit(1);
+    }
+    memcpy(&result.address,info->ai_addr,info->ai_addrlen);
+    result.length=info->ai_addrlen;
+    result.family=info->ai_family;
+    freeaddrinfo(info);
+    return result;
+}
+
+// Send or receive all of size bytes.  Return false if the connection is lost.
+static bool Send_All(int fd,const void* data,size_t size)
+{
+    const char* p=(const char*)data;
+    while(size>0)
+    {
+        ssize_t n=send(fd,p,size,MSG_NOSIGNAL);
+        if(n<0 && errno==EINTR) continue;
+        if(n<=0) return false;
+        p+=n;
+        size-=n;
+    }
+    return true;
+}
+
+static bool Receive_All(int fd,void* data,size_t size)
+{
+    char* p=(char*)data;
+    while(size>0)
+    {
+        ssize_t n=recv(fd,p,size,0);
+        if(n<0 && errno==EINTR) continue;
+        if(n<=0) return false;
+        p+=n;
+        size-=n;
+    }
+    return true;
+}
+
+// Connect to the coordinator, which may not be listening yet, and render the
+// jobs it hands out until it is done.  The world must have been prepared
+// (Render_World::Prepare).
+void Run_Worker(Render_World& render_world,const char* address)
+{
+    Socket_Address coordinator=Resolve(address,false);
+    int fd=-1;
+    for(int attempt=0;;attempt++)
+    {
+        fd=socket(coordinator.family,SOCK_STREAM,0);
+        if(fd>=0 && !connect(fd,(sockaddr*)&coordinator.address,coordinator.length))
+            break;
+        if(fd>=0) close(fd);
+        if(attempt==100)
+        {
+            perror(address);
+            exit(1);
+        }
+        usleep(100000);
+    }
+    Keep_Alive(fd,coordinator.family);
+
+    uint32_t magic=worker_magic;
+    uint64_t key=Scene_Key(render_world);
+    if(!Send_All(fd,&magic,sizeof(magic)) || !Send_All(fd,&key,sizeof(key)))
+    {
+        close(fd);
+        return;
+    }
+
+    ivec2 tiles=render_world.Number_Tiles();
+    int width=render_world.camera.number_pixels[0];
+    std::vector<int> row_tiles(tiles[0]);
+    int jobs=0;
+    int32_t job;
+    while(Receive_All(fd,&job,sizeof(job)) && job>=0 && job<tiles[1])
+    {
+        for(int i=0;i<tiles[0];i++) row_tiles[i]=job*tiles[0]+i;
+        render_world.Render_Tiles(row_tiles);
+
+        ivec2 begin,end;
+        render_world.Tile_Bounds(row_tiles[0],begin,end);
+        const Pixel* pixels=render_world.camera.colors+begin[1]*width;
+        if(!Send_All(fd,&job,sizeof(job)) ||
+            !Send_All(fd,pixels,sizeof(Pixel)*width*(end[1]-begin[1])))
+            break;
+        jobs++;
+    }
+    close(fd);
+    if(print_statistics)
+        std::cout<<"worker "<<getpid()<<": rendered "<<jobs<<" jobs"<<std::endl;
+}
+
+// A worker as seen by the coordinator
+struct Worker_Connection
+{
+    int fd;
+    bool accepted=false; // its scene key matched
+    std::vector<char> input; // received but not yet handled
+    std::vector<int> jobs; // handed out and not yet returned
+    int done=0;
+};
+
+// Listen at address, start local_workers worker processes, and render the
+// image with the workers that connect.  Local workers are forked from this
+// process once it has prepared the world, so they share its parse of the
+// scene and its acceleration structure, and they split the threads (-j)
+// between them.
+void Run_Coordinator(Render_World& render_world,const char* address,int local_workers)
+{
+    Socket_Address local=Resolve(address,true);
+    if(!local.path.empty()) unlink(local.path.c_str());
+    int listener=socket(local.family,SOCK_STREAM,0);
+    int one=1;
+    if(listener>=0) setsockopt(listener,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+    if(listener<0 || bind(listener,(sockaddr*)&local.address,local.length) || listen(listener,64))
+    {
+        perror(address);
+        exit(1);
+    }
+
+    std::vector<pid_t> children;
+    int worker_threads=std::max(1,Number_Threads()/std::max(1,local_workers));
+    if(local_workers>0) render_world.Prepare();
+    for(int w=0;w<local_workers;w++)
+    {
+        pid_t pid=fork();
+        if(pid<0)
+        {
+            perror("fork");
+            exit(1);
+        }
+        if(pid==0)
+        {
+            close(listener);
+            number_threads=worker_threads;
+            Run_Worker(render_world,address);
+            _exit(0);
+        }
+        children.push_back(pid);
+    }
+
+    ivec2 tiles=render_world.Number_Tiles();
+    int width=render_world.camera.number_pixels[0];
+    uint64_t key=Scene_Key(render_world);
+    std::deque<int> pending;
+    for(int j=0;j<tiles[1];j++) pending.push_back(j);
+    std::vector<bool> finished(tiles[1],false);
+    int remaining=tiles[1],reissued=0,copied=0,rejected=0;
+    std::vector<Worker_Connection> workers;
+    std::vector<Worker_Connection> retired; // for statistics
+
+    // The bytes of the reply to job
+    auto reply_size=[&](int job)
+    {
+        ivec2 begin,end;
+        render_world.Tile_Bounds(job*tiles[0],begin,end);
+        return sizeof(int32_t)+sizeof(Pixel)*width*(end[1]-begin[1]);
+    };
+    // Give the unfinished jobs of a lost worker to the others
+    auto drop=[&](size_t w)
+    {
+        Worker_Connection& worker=workers[w];
+        for(int job:worker.jobs)
+        {
+            if(finished[job]) continue;
+            pending.push_front(job);
+            reissued++;
+        }
+        close(worker.fd);
+        retired.push_back(std::move(worker));
+        workers.erase(workers.begin()+w);
+    };
+
+    // The next job for worker: a pending one, or once there are none and the
+    // worker is idle, a copy of the unfinished job that the fewest workers
+    // have.  Returns -1 if there is none.
+    std::vector<int> copies;
+    auto next_job=[&](const Worker_Connection& worker)
+    {
+        while(!pending.empty())
+        {
+            int job=pending.front();
+            pending.pop_front();
+            if(!finished[job]) return job;
+        }
+        if(!worker.jobs.empty()) return -1;
+        copies.assign(tiles[1],0);
+        for(const auto& other:workers)
+            for(int job:other.jobs) copies[job]++;
+        int best=-1;
+        for(const auto& other:workers)
+            for(int job:other.jobs)
+                if(!finished[job] && (best<0 || copies[job]<copies[best]))
+                    best=job;
+        if(best>=0) copied++;
+        return best;
+    };
+
+    std::vector<pollfd> fds;
+    std::vector<char> buffer(1<<16);
+    while(remaining>0)
+    {
+        // Hand out jobs
+        for(size_t w=0;w<workers.size();)
+        {
+            Worker_Connection& worker=workers[w];
+            bool lost=false;
+            while(worker.accepted && (int)worker.jobs.size()<jobs_per_worker)
+            {
+                int32_t job=next_job(worker);
+                if(job<0) break;
+                worker.jobs.push_back(job);
+                if(!Send_All(worker.fd,&job,sizeof(job)))
+                {
+                    lost=true;
+                    break;
+                }
+            }
+            if(lost) drop(w);
+            else w++;
+        }
+
+        // With no workers left to connect, the image cannot be finished.
+        if(workers.empty() && !children.empty())
+        {
+            for(size_t c=0;c<children.size();)
+                if(waitpid(children[c],nullptr,WNOHANG)>0) children.erase(children.begin()+c);
+                else c++;
+            if(children.empty())
+            {
+                std::cerr<<"Error: all local workers exited"<<std::endl;
+                exit(1);
+            }
+        }
+
+        fds.assign(1,{listener,POLLIN,0});
+        for(const auto& worker:workers) fds.push_back({worker.fd,POLLIN,0});
+        if(poll(fds.data(),fds.size(),1000)<0)
+        {
+            if(errno==EINTR) continue;
+            perror("poll");
+            exit(1);
+        }
+
+        // Read what the workers sent, newest worker first so that dropping
+        // one does not disturb the indices of those left to read.
+        for(size_t w=workers.size();w-->0;)
+        {
+            if(!fds[w+1].revents) continue;
+            Worker_Connection& worker=workers[w];
+            ssize_t n=recv(worker.fd,buffer.data(),buffer.size(),0);
+            if(n<0 && errno==EINTR) continue;
+            if(n<=0)
+            {
+                drop(w);
+                continue;
+            }
+            worker.input.insert(worker.input.end(),buffer.begin(),buffer.begin()+n);
+
+            size_t used=0;
+            bool lost=false;
+            if(!worker.accepted && worker.input.size()>=sizeof(uint32_t)+sizeof(uint64_t))
+            {
+                uint32_t magic;
+                uint64_t worker_key;
+                memcpy(&magic,worker.input.data(),sizeof(magic));
+                memcpy(&worker_key,worker.input.data()+sizeof(magic),sizeof(worker_key));
+                used=sizeof(magic)+sizeof(worker_key);
+                if(magic!=worker_magic || worker_key!=key)
+                {
+                    std::cerr<<"rejected a worker with a different scene or options"<<std::endl;
+                    rejected++;
+                    lost=true;
+                }
+                else worker.accepted=true;
+            }
+            while(worker.accepted && !lost && worker.input.size()-used>=sizeof(int32_t))
+            {
+                int32_t job;
+                memcpy(&job,worker.input.data()+used,sizeof(job));
+                auto it=std::find(worker.jobs.begin(),worker.jobs.end(),job);
+                if(it==worker.jobs.end())
+                {
+                    lost=true;
+                    break;
+                }
+                size_t size=reply_size(job);
+                if(worker.input.size()-used<size) break;
+                if(!finished[job])
+                {
+                    ivec2 begin,end;
+                    render_world.Tile_Bounds(job*tiles[0],begin,end);
+                    memcpy(render_world.camera.colors+begin[1]*width,
+                        worker.input.data()+used+sizeof(job),size-sizeof(job));
+                    finished[job]=true;
+                    remaining--;
+                }
+                worker.jobs.erase(it);
+                worker.done++;
+                used+=size;
+            }
+            if(lost)
+            {
+                drop(w);
+                continue;
+            }
+            worker.input.erase(worker.input.begin(),worker.input.begin()+used);
+        }
+
+        if(fds[0].revents & POLLIN)
+        {
+            int fd=accept(listener,nullptr,nullptr);
+            if(fd>=0)
+            {
+                Keep_Alive(fd,local.family);
+                Worker_Connection worker;
+                worker.fd=fd;
+                workers.push_back(std::move(worker));
+            }
+        }
+    }
+
+    int32_t done=-1;
+    for(auto& worker:workers)
+    {
+        Send_All(worker.fd,&done,sizeof(done));
+        close(worker.fd);
+    }
+    close(listener);
+    if(!local.path.empty()) unlink(local.path.c_str());
+    for(pid_t pid:children) waitpid(pid,nullptr,0);
+
+    if(print_statistics)
+    {
+        std::cout<<"distributed: "<<tiles[1]<<" jobs over "<<workers.size()+retired.size()
+                 <<" workers; reissued: "<<reissued<<"; copied: "<<copied
+                 <<"; rejected workers: "<<rejected
+                 <<"; jobs per worker:";
+        for(const auto& worker:retired) std::cout<<" "<<worker.done;
+        for(const auto& worker:workers) std::cout<<" "<<worker.done;
+        std::cout<<std::endl;
+    }
+}
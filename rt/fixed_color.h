@@ -20,6 +20,11 @@ public:
         return color;
     }
 
+    virtual void Get_Colors(const vec2 uv[],int n,vec3 colors[]) const override
+    {
+        for(int i=0;i<n;i++) colors[i]=color;
+    }
+
     static constexpr const char* parse_name = "color";
 };
 
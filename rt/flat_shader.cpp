@@ -1,6 +1,7 @@
 #include "flat_shader.h"
 #include "parse.h"
 #include "color.h"
+#include <algorithm>
 
 Flat_Shader::Flat_Shader(const Parse* parse,std::istream& in)
 {
@@ -8,9 +9,17 @@ Flat_Shader::Flat_Shader(const Parse* parse,std::istream& in)
     color=parse->Get_Color(in);
 }
 
-vec3 Flat_Shader::
-Shade_Surface(const Render_World& render_world,const Ray& ray,const Hit& hit,
-    const vec3& intersection_point,const vec3& normal,int recursion_depth) const
+void Flat_Shader::
+Combine(const Render_World& render_world,Shading_Point* const points[],int n,
+    int recursion_depth) const
 {
-    return color->Get_Color(hit.uv);
+    vec2 uv[shading_chunk];
+    vec3 colors[shading_chunk];
+    for(int begin=0;begin<n;begin+=shading_chunk)
+    {
+        int m=std::min(shading_chunk,n-begin);
+        for(int i=0;i<m;i++) uv[i]=points[begin+i]->hit.uv;
+        color->Get_Colors(uv,m,colors);
+        for(int i=0;i<m;i++) points[begin+i]->color=colors[i];
+    }
 }
@@ -12,9 +12,8 @@ public:
     Flat_Shader(const Parse* parse,std::istream& in);
     virtual ~Flat_Shader() = default;
     
-    virtual vec3 Shade_Surface(const Render_World& render_world,const Ray& ray,
-        const Hit& hit,const vec3& intersection_point,const vec3& normal,
-        int recursion_depth) const override;
+    virtual void Combine(const Render_World& render_world,Shading_Point* const points[],
+        int n,int recursion_depth) const override;
     
     static constexpr const char* parse_name = "flat_shader";
 };
@@ -0,0 +1,613 @@
+#include "hierarchy.h"
+#include "cache.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <queue>
+
+static double Surface_Area(const Box& b)
+{
+    vec3 s=b.hi-b.lo;
+    return 2*(s[0]*s[1]+s[1]*s[2]+s[2]*s[0]);
+}
+
+static Box Padded_Box(Box b)
+{
+    vec3 size=b.hi-b.lo;
+    double pad=1e-4*std::max(size[0],std::max(size[1],size[2]))+1e-8;
+    b.lo-=pad;
+    b.hi+=pad;
+    return b;
+}
+
+static bool Same_Box(const Box& a,const Box& b)
+{
+    for(int i=0;i<3;i++)
+        if(a.lo[i]!=b.lo[i] || a.hi[i]!=b.hi[i])
+            return false;
+    return true;
+}
+
+void Hierarchy::Clear_Entries(size_t capacity)
+{
+    entries.clear();
+    entry_boxes.clear();
+    entries.reserve(capacity);
+    entry_boxes.reserve(capacity);
+}
+
+void Hierarchy::Add_Entry(const Object* obj,int part,int id)
+{
+    Add_Entry(obj,part,id,obj->Bounding_Box(part).first);
+}
+
+void Hierarchy::Add_Entry(const Object* obj,int part,int id,const Box& box)
+{
+    entries.push_back({obj,part,id});
+    entry_boxes.push_back(Padded_Box(box));
+}
+
+void Hierarchy::Apply_Order(const std::vector<int>& order)
+{
+    int n=order.size();
+    std::vector<Entry> reordered(n);
+    std::vector<Box> reordered_boxes(n);
+    Parallel_For(0,n,[&](int i)
+        {
+            reordered[i]=entries[order[i]];
+            reordered_boxes[i]=entry_boxes[order[i]];
+        });
+    entries.swap(reordered);
+    entry_boxes.swap(reordered_boxes);
+}
+
+// Sort the pairs (key,value) by key with a parallel LSD radix sort, one byte
+// at a time.  Each chunk of the input counts its digits, the counts are
+// turned into per-chunk output offsets, and then each chunk scatters its
+// pairs.  Digits that are the same for every key are skipped.
+static void Radix_Sort(std::vector<std::pair<uint64_t,int>>& pairs)
+{
+    int n=pairs.size();
+    int chunks=Number_Chunks(n);
+    std::vector<std::pair<uint64_t,int>> scratch(n);
+    std::vector<int> counts(chunks*256);
+    for(int shift=0;shift<64;shift+=8)
+    {
+        std::fill(counts.begin(),counts.end(),0);
+        Parallel_Chunks(0,n,chunks,[&](int t,int b,int e)
+            {
+                int* c=&counts[t*256];
+                for(int i=b;i<e;i++) c[(pairs[i].first>>shift)&255]++;
+            });
+
+        int total=0;
+        bool constant_digit=false;
+        for(int d=0;d<256;d++)
+            for(int t=0;t<chunks;t++)
+            {
+                int c=counts[t*256+d];
+                if(c==n) constant_digit=true;
+                counts[t*256+d]=total;
+                total+=c;
+            }
+        if(constant_digit) continue;
+
+        Parallel_Chunks(0,n,chunks,[&](int t,int b,int e)
+            {
+                int* c=&counts[t*256];
+                for(int i=b;i<e;i++) scratch[c[(pairs[i].first>>shift)&255]++]=pairs[i];
+            });
+        pairs.swap(scratch);
+    }
+}
+
+// Order the entries along a Morton curve through the centers of their boxes.
+// The sorted entries are then rotated into place so that an in-order walk of
+// the tree's leaves visits them in curve order.  (The leaves in the bottom
+// row of the tree come first in that walk but last in entries.)
+void Hierarchy::Reorder_Morton()
+{
+    int n=entries.size();
+    Box bounds;
+    bounds.Make_Empty();
+    for(const auto& b:entry_boxes)
+        bounds.Include_Point((b.lo+b.hi)*0.5);
+    vec3 scale=bounds.hi-bounds.lo;
+    for(int i=0;i<3;i++)
+        scale[i]=scale[i]>0?(1<<21)/scale[i]:0;
+
+    std::vector<std::pair<uint64_t,int>> codes(n);
+    Parallel_For(0,n,[&](int i)
+        {
+            vec3 c=((entry_boxes[i].lo+entry_boxes[i].hi)*0.5-bounds.lo)*scale;
+            uint64_t code=0;
+            for(int a=0;a<3;a++)
+            {
+                uint64_t q=(uint64_t)std::max(0.0,std::min(c[a],(double)((1<<21)-1)));
+                code|=Spread_Bits(q)<<(2-a);
+            }
+            codes[i]={code,i};
+        });
+    Radix_Sort(codes);
+
+    int first_bottom=1;
+    while(first_bottom<=2*n-1) first_bottom*=2;
+    first_bottom=first_bottom/2-1;
+    int rotation=first_bottom-(n-1);
+
+    std::vector<int> order(n);
+    Parallel_For(0,n,[&](int k)
+        {
+            order[(rotation+k)%n]=codes[k].second;
+        });
+    Apply_Order(order);
+}
+
+// Reorder the entries vector so that adjacent entries tend to be nearby.
+void Hierarchy::Reorder_Entries()
+{
+    int n=entries.size();
+    if(n<=2) return;
+    if(builder==morton_builder)
+    {
+        Reorder_Morton();
+        return;
+    }
+
+    // Number of leaves below each node of the complete tree.
+    std::vector<int> leaf_count(2*n-1,1);
+    for(int i=n-2;i>=0;i--)
+        leaf_count[i]=leaf_count[2*i+1]+leaf_count[2*i+2];
+
+    std::vector<int> order(n);
+    for(int i=0;i<n;i++) order[i]=i;
+    std::vector<int> reordered(n);
+    Reorder_SAH(0,leaf_count,order,0,n,reordered);
+    Apply_Order(reordered);
+}
+
+// Assign the entries order[begin,end) to the leaves below node.  The left
+// child receives exactly leaf_count[2*node+1] of them; the axis used to pick
+// which ones is the one with the lowest SAH cost.
+void Hierarchy::Reorder_SAH(int node,const std::vector<int>& leaf_count,
+    std::vector<int>& order,int begin,int end,
+    std::vector<int>& reordered) const
+{
+    if(Is_Leaf(node))
+    {
+        reordered[Leaf_Entry(node)]=order[begin];
+        return;
+    }
+    int mid=begin+leaf_count[2*node+1];
+    auto centroid=[this](int e,int axis)
+    {
+        const Box& b=entry_boxes[e];
+        return b.lo[axis]+b.hi[axis];
+    };
+
+    int best_axis=0;
+    double best_cost=std::numeric_limits<double>::infinity();
+    for(int axis=0;axis<3;axis++)
+    {
+        std::nth_element(order.begin()+begin,order.begin()+mid,
+            order.begin()+end,[&centroid,axis](int a,int b)
+            {return centroid(a,axis)<centroid(b,axis);});
+        Box left,right;
+        left.Make_Empty();
+        right.Make_Empty();
+        for(int i=begin;i<mid;i++) left=left.Union(entry_boxes[order[i]]);
+        for(int i=mid;i<end;i++) right=right.Union(entry_boxes[order[i]]);
+        double cost=Surface_Area(left)*(mid-begin)+Surface_Area(right)*(end-mid);
+        if(cost<best_cost)
+        {
+            best_cost=cost;
+            best_axis=axis;
+        }
+    }
+    if(best_axis!=2)
+        std::nth_element(order.begin()+begin,order.begin()+mid,
+            order.begin()+end,[&centroid,best_axis](int a,int b)
+            {return centroid(a,best_axis)<centroid(b,best_axis);});
+
+    Reorder_SAH(2*node+1,leaf_count,order,begin,mid,reordered);
+    Reorder_SAH(2*node+2,leaf_count,order,mid,end,reordered);
+}
+
+static Box To_Box(const Box& b) {return b;}
+static Box To_Box(const Float_Box& b) {return b.To_Box();}
+
+// Populate tree from entries.  In single precision, the tree is built in
+// double precision and then rounded outward into float_tree.
+void Hierarchy::Build_Tree()
+{
+    int n=entries.size();
+    tree.clear();
+    float_tree.clear();
+    if(!n) return;
+    tree.resize(2*n-1);
+    Parallel_For(0,n,[this](int i){tree[Leaf_Node(i)]=entry_boxes[i];});
+    std::vector<Box>().swap(entry_boxes);
+
+    // Fill in the internal nodes one row at a time, starting from the
+    // deepest.  The nodes within a row are independent of each other.
+    int row=1;
+    while(2*row-1<=n-2) row*=2;
+    for(;row>=1;row/=2)
+    {
+        int begin=row-1,end=std::min(2*row-1,n-1);
+        Parallel_For(begin,end,[this](int i)
+            {tree[i]=tree[2*i+1].Union(tree[2*i+2]);});
+    }
+
+    if(single_precision)
+    {
+        float_tree.resize(tree.size());
+        Parallel_For(0,tree.size(),[this](int i){float_tree[i]=Float_Box(tree[i]);});
+        std::vector<Box>().swap(tree);
+    }
+    Compute_Area_Sum();
+    build_cost=Cost();
+}
+
+template<class Node> double Hierarchy::Area_Sum(const std::vector<Node>& boxes)
+{
+    double sum=0;
+    for(const auto& b:boxes) sum+=Surface_Area(To_Box(b));
+    return sum;
+}
+
+void Hierarchy::Compute_Area_Sum()
+{
+    area_sum=float_tree.empty()?Area_Sum(tree):Area_Sum(float_tree);
+}
+
+double Hierarchy::Cost() const
+{
+    if(Empty()) return 0;
+    double root=Surface_Area(float_tree.empty()?tree[0]:float_tree[0].To_Box());
+    return root>0?area_sum/root:0;
+}
+
+size_t Hierarchy::Memory_Usage() const
+{
+    return entries.size()*sizeof(Entry)+tree.size()*sizeof(Box)
+        +float_tree.size()*sizeof(Float_Box);
+}
+
+int Hierarchy::Refit(const std::function<const Object*(int id)>& object)
+{
+    if(float_tree.empty()) return Refit(tree,object);
+    return Refit(float_tree,object);
+}
+
+// Only the nodes above changed leaves are recomputed.  Nodes are taken from a
+// priority queue largest index first; since a parent always has a smaller
+// index than its children, both children of a node are final by the time it
+// is taken, and duplicates of a node come out together.  In single precision,
+// a leaf only changes if its rounded box does.
+template<class Node> int Hierarchy::Refit(std::vector<Node>& boxes,
+    const std::function<const Object*(int id)>& object)
+{
+    std::priority_queue<int> queue;
+    int changed=0;
+    for(size_t i=0;i<entries.size();i++)
+    {
+        Entry& e=entries[i];
+        e.obj=object(e.id);
+        int node=Leaf_Node(i);
+        Node b(Padded_Box(e.obj->Bounding_Box(e.part).first));
+        if(Same_Box(To_Box(b),To_Box(boxes[node]))) continue;
+        area_sum+=Surface_Area(To_Box(b))-Surface_Area(To_Box(boxes[node]));
+        boxes[node]=b;
+        changed++;
+        if(node) queue.push((node-1)/2);
+    }
+    while(!queue.empty())
+    {
+        int node=queue.top();
+        queue.pop();
+        while(!queue.empty() && queue.top()==node) queue.pop();
+        Node b(To_Box(boxes[2*node+1]).Union(To_Box(boxes[2*node+2])));
+        area_sum+=Surface_Area(To_Box(b))-Surface_Area(To_Box(boxes[node]));
+        boxes[node]=b;
+        if(node) queue.push((node-1)/2);
+    }
+    return changed;
+}
+
+// Only the part and id of each entry are saved along with the tree, which
+// holds the boxes.
+void Hierarchy::Save(Cache_Writer& out) const
+{
+    std::vector<ivec2> ids(entries.size());
+    for(size_t i=0;i<entries.size();i++)
+        ids[i]=ivec2(entries[i].part,entries[i].id);
+    out.Write(builder);
+    out.Write(ids);
+    out.Write(tree);
+    out.Write(float_tree);
+}
+
+bool Hierarchy::Load(Cache_Reader& in,const std::vector<Entry>& expected)
+{
+    std::vector<ivec2> ids;
+    Clear_Entries();
+    auto fail=[this]()
+    {
+        entries.clear();
+        tree.clear();
+        float_tree.clear();
+        return false;
+    };
+    if(!in.Read(builder) || !in.Read(ids) || !in.Read(tree) ||
+        !in.Read(float_tree) || (builder!=sah_builder && builder!=morton_builder) ||
+        ids.size()!=expected.size() || (!tree.empty() && !float_tree.empty()) ||
+        tree.size()+float_tree.size()!=(ids.empty()?0:2*ids.size()-1))
+        return fail();
+
+    // Each saved (part,id) must match a different expected entry.
+    auto less=[](const Entry& a,const Entry& b)
+    {
+        return a.id<b.id || (a.id==b.id && a.part<b.part);
+    };
+    std::vector<Entry> sorted(expected);
+    std::sort(sorted.begin(),sorted.end(),less);
+    std::vector<bool> used(sorted.size());
+    entries.resize(ids.size());
+    for(size_t i=0;i<ids.size();i++)
+    {
+        Entry e={nullptr,ids[i][0],ids[i][1]};
+        auto it=std::lower_bound(sorted.begin(),sorted.end(),e,less);
+        if(it==sorted.end() || it->id!=e.id || it->part!=e.part ||
+            used[it-sorted.begin()])
+            return fail();
+        used[it-sorted.begin()]=true;
+        entries[i]=*it;
+    }
+    single_precision=!float_tree.empty();
+    Compute_Area_Sum();
+    build_cost=Cost();
+    return true;
+}
+
+// Return a list of candidates (indices into the entries list) whose
+// bounding boxes intersect the ray.
+void Hierarchy::Intersection_Candidates(const Ray& ray, std::vector<int>& candidates) const
+{
+    if(float_tree.empty()) Intersection_Candidates(tree,ray,candidates);
+    else Intersection_Candidates(float_tree,ray,candidates);
+}
+
+template<class Node> void Hierarchy::Intersection_Candidates(
+    const std::vector<Node>& boxes,const Ray& ray,std::vector<int>& candidates) const
+{
+    candidates.clear();
+    Precomputed_Ray r(ray);
+    if(boxes.empty() || !boxes[0].Intersection(r).first) return;
+    std::vector<int> stack={0};
+    while(!stack.empty())
+    {
+        int node=stack.back();
+        stack.pop_back();
+        if(Is_Leaf(node))
+        {
+            candidates.push_back(Leaf_Entry(node));
+            continue;
+        }
+        auto a=boxes[2*node+1].Intersection(r);
+        auto b=boxes[2*node+2].Intersection(r);
+        if(a.first && b.first)
+        {
+            bool swap=b.second<a.second;
+            stack.push_back(swap?2*node+1:2*node+2);
+            stack.push_back(swap?2*node+2:2*node+1);
+        }
+        else if(a.first) stack.push_back(2*node+1);
+        else if(b.first) stack.push_back(2*node+2);
+    }
+}
+
+// Find the nodes below the interior node that the ray enters no later than
+// t_max, storing them in nodes and their entry distances in t.  Return the
+// number found.  When both children are interior nodes, their four children
+// are consecutive in the tree and are tested together instead, which skips a
+// level of the tree.  A ray that misses a child misses its children too, so
+// this finds a subset of what testing the children would.
+template<class Node> int Hierarchy::Descend(const std::vector<Node>& boxes,
+    const Precomputed_Ray& ray,int node,double t_max,int nodes[4],double t[4]) const
+{
+    int child=2*node+1,n=0;
+    if(Is_Leaf(child+1))
+    {
+        for(int c=child;c<=child+1;c++)
+        {
+            auto b=boxes[c].Intersection(ray,t_max);
+            if(!b.first) continue;
+            nodes[n]=c;
+            t[n++]=b.second;
+        }
+        return n;
+    }
+    int first=2*child+1;
+    double4 t_enter;
+    int mask=Node::Intersection(ray,&boxes[first],t_max,t_enter);
+    for(int k=0;k<4;k++)
+    {
+        if(!(mask&(1<<k))) continue;
+        nodes[n]=first+k;
+        t[n++]=t_enter[k];
+    }
+    return n;
+}
+
+std::pair<int,Hit> Hierarchy::Closest_Intersection(const Ray& ray,
+    long long* steps,long long* tests) const
+{
+    if(float_tree.empty()) return Closest_Intersection(tree,ray,steps,tests);
+    return Closest_Intersection(float_tree,ray,steps,tests);
+}
+
+template<class Node> std::pair<int,Hit> Hierarchy::Closest_Intersection(
+    const std::vector<Node>& boxes,const Ray& ray,long long* steps,
+    long long* tests) const
+{
+    std::pair<int,Hit> closest={-1,{}};
+    closest.second.dist=std::numeric_limits<double>::infinity();
+    if(boxes.empty()) return closest;
+    Precomputed_Ray r(ray);
+    auto root=boxes[0].Intersection(r);
+    if(!root.first) return closest;
+
+    // Each stack entry is a node along with the distance at which the ray
+    // enters its box.  The tree depth is at most about 64, and each step
+    // pushes at most four nodes, so a fixed stack is sufficient.
+    std::pair<int,double> stack[256];
+    int size=0;
+    stack[size++]={0,root.second};
+    long long visited=0,tested=0;
+    while(size)
+    {
+        auto [node,t]=stack[--size];
+        if(t>closest.second.dist) continue;
+        visited++;
+        if(Is_Leaf(node))
+        {
+            const Entry& e=entries[Leaf_Entry(node)];
+            tested++;
+            Hit hit=e.obj->Intersection(ray,e.part);
+            if(hit.Valid() && hit.dist>=small_t && hit.dist<closest.second.dist)
+                closest={Leaf_Entry(node),hit};
+            continue;
+        }
+
+        // Push the nodes farthest first so that the nearest is visited next.
+        int nodes[4];
+        double t_enter[4];
+        int n=Descend(boxes,r,node,closest.second.dist,nodes,t_enter);
+        for(int i=1;i<n;i++)
+            for(int j=i;j>0 && t_enter[j]>t_enter[j-1];j--)
+            {
+                std::swap(t_enter[j],t_enter[j-1]);
+                std::swap(nodes[j],nodes[j-1]);
+            }
+        for(int i=0;i<n;i++)
+            stack[size++]={nodes[i],t_enter[i]};
+    }
+    if(steps) *steps+=visited;
+    if(tests) *tests+=tested;
+    return closest;
+}
+
+void Hierarchy::Closest_Intersection(const Ray_Packet& packet,int mask,
+    int entry[],Hit hits[],long long* steps,long long* tests) const
+{
+    if(float_tree.empty())
+        Closest_Intersection(tree,packet,mask,entry,hits,steps,tests);
+    else Closest_Intersection(float_tree,packet,mask,entry,hits,steps,tests);
+}
+
+template<class Node> void Hierarchy::Closest_Intersection(
+    const std::vector<Node>& boxes,const Ray_Packet& packet,int mask,
+    int entry[],Hit hits[],long long* steps,long long* tests) const
+{
+    double4 closest=Splat(std::numeric_limits<double>::infinity());
+    for(int k=0;k<packet_size;k++)
+    {
+        if(!(mask&(1<<k))) continue;
+        entry[k]=-1;
+        hits[k]=Hit();
+        hits[k].dist=closest[k];
+    }
+    if(boxes.empty()) return;
+
+    // Children are ordered front to back by comparing their centers along
+    // the direction of the first active ray.
+    int lead=0;
+    while(!(mask&(1<<lead))) lead++;
+    vec3 direction;
+    for(int i=0;i<3;i++) direction[i]=packet.direction[i][lead];
+
+    int stack[128];
+    int size=0;
+    stack[size++]=0;
+    long long visited=0,tested=0;
+    while(size)
+    {
+        int node=stack[--size];
+        visited++;
+        int active=boxes[node].Intersection(packet,closest)&mask;
+        if(!active) continue;
+        if(Is_Leaf(node))
+        {
+            const Entry& e=entries[Leaf_Entry(node)];
+            Hit leaf_hits[packet_size];
+            e.obj->Packet_Intersection(packet,e.part,active,leaf_hits);
+            for(int k=0;k<packet_size;k++)
+            {
+                if(!(active&(1<<k))) continue;
+                tested++;
+                const Hit& hit=leaf_hits[k];
+                if(hit.Valid() && hit.dist>=small_t && hit.dist<hits[k].dist)
+                {
+                    entry[k]=Leaf_Entry(node);
+                    hits[k]=hit;
+                    closest[k]=hit.dist;
+                }
+            }
+            continue;
+        }
+        Box a=To_Box(boxes[2*node+1]);
+        Box b=To_Box(boxes[2*node+2]);
+        bool left_first=dot(a.lo+a.hi-b.lo-b.hi,direction)<=0;
+        stack[size++]=left_first?2*node+2:2*node+1;
+        stack[size++]=left_first?2*node+1:2*node+2;
+    }
+    if(steps) *steps+=visited;
+    if(tests) *tests+=tested;
+}
+
+bool Hierarchy::Any_Intersection(const Ray& ray,double t_max,
+    long long* steps,long long* tests,Occluder* occluder) const
+{
+    if(float_tree.empty()) return Any_Intersection(tree,ray,t_max,steps,tests,occluder);
+    return Any_Intersection(float_tree,ray,t_max,steps,tests,occluder);
+}
+
+template<class Node> bool Hierarchy::Any_Intersection(
+    const std::vector<Node>& boxes,const Ray& ray,double t_max,
+    long long* steps,long long* tests,Occluder* occluder) const
+{
+    if(boxes.empty()) return false;
+    Precomputed_Ray r(ray);
+    auto root=boxes[0].Intersection(r,t_max);
+    if(!root.first || root.second>=t_max) return false;
+    int stack[256];
+    int size=0;
+    stack[size++]=0;
+    long long visited=0,tested=0;
+    bool found=false;
+    while(size && !found)
+    {
+        int node=stack[--size];
+        visited++;
+        if(Is_Leaf(node))
+        {
+            const Entry& e=entries[Leaf_Entry(node)];
+            tested++;
+            int part=e.part;
+            found=e.obj->Any_Intersection(ray,e.part,t_max,&part);
+            if(found && occluder) *occluder={e.obj,part};
+            continue;
+        }
+        int nodes[4];
+        double t_enter[4];
+        int n=Descend(boxes,r,node,t_max,nodes,t_enter);
+        for(int i=n-1;i>=0;i--)
+            if(t_enter[i]<t_max)
+                stack[size++]=nodes[i];
+    }
+    if(steps) *steps+=visited;
+    if(tests) *tests+=tested;
+    return found;
+}
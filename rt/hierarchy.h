@@ -2,6 +2,10 @@
 #define __HIERARCHY_H__
 
 #include "object.h"
+#include <functional>
+
+class Cache_Reader;
+class Cache_Writer;
 
 /*
   A hierarchy is a binary tree.  We represent the hierarchy as a complete
@@ -22,13 +26,26 @@
 
   Note that if entries has n entries, then tree will have 2*n-1 entries.
   The last n elements of tree correspond to the elements of entries (in order).
+
+  Because the shape of the tree is fixed by the number of entries, building
+  the hierarchy amounts to choosing the order of the entries.  There are two
+  ways to choose it (see Hierarchy_Builder).  The SAH builder works top-down
+  with the surface area heuristic: each node splits its entries into the two
+  fixed-size groups required by its children along the axis that minimizes
+  area(left)*n_left+area(right)*n_right.  The Morton builder sorts the
+  entries along a Morton (Z-order) curve through their box centers, which is
+  a linear BVH (LBVH).  It gives somewhat worse trees, but it is much faster
+  and runs in parallel.
 */
 
+enum Hierarchy_Builder {sah_builder,morton_builder};
+
+// The box of an entry is that of its leaf in the tree.
 struct Entry
 {
-    Object* obj;
+    const Object* obj;
     int part;
-    Box box;
+    int id;
 };
 
 class Hierarchy
@@ -37,8 +54,27 @@ public:
     // List of primitives (or parts of primitives) that can be intersected
     std::vector<Entry> entries;
 
-    // Flattened hierarchy
+    // Flattened hierarchy.  Only one of these is used: float_tree when the
+    // hierarchy is built with single_precision set and tree otherwise.
     std::vector<Box> tree;
+    std::vector<Float_Box> float_tree;
+
+    // Store the tree boxes in single precision (rounded outward), which
+    // halves the memory they take.
+    bool single_precision=false;
+
+    // How Reorder_Entries orders the entries.
+    Hierarchy_Builder builder=sah_builder;
+
+    // Remove all entries, making room for capacity new ones.
+    void Clear_Entries(size_t capacity=0);
+
+    // Append an entry for part of obj.  Its box is padded slightly, since
+    // triangle hits are accepted a little outside the triangle (weight_tol).
+    void Add_Entry(const Object* obj,int part,int id);
+    // Same, with the (unpadded) box of the part given instead of taken from
+    // obj->Bounding_Box.
+    void Add_Entry(const Object* obj,int part,int id,const Box& box);
 
     // Reorder the entries vector so that adjacent entries tend to be nearby.
     void Reorder_Entries();
@@ -46,8 +82,105 @@ public:
     // Populate tree from entries.
     void Build_Tree();
 
+    // For animation.  Give each entry the object returned by object(id),
+    // recompute its box, and update the boxes of the tree nodes above the
+    // entries whose leaf boxes changed.  The order of the entries is kept, so
+    // the tree can get much worse if the primitives move a lot (see Cost).
+    // Returns the number of leaf boxes that changed.
+    int Refit(const std::function<const Object*(int id)>& object);
+
+    // The sum of the surface areas of all tree nodes divided by the surface
+    // area of the root.  This is proportional to the expected cost of tracing
+    // a ray through the tree under the surface area heuristic.
+    double Cost() const;
+
+    // The value of Cost() when the tree was last built.
+    double build_cost=0;
+
+    // Frame sequences (-n) build a refitted tree again once Cost() has grown
+    // by more than this factor since the tree was built.
+    static constexpr double rebuild_threshold=1.5;
+
+    bool Empty() const {return tree.empty() && float_tree.empty();}
+
+    // Bytes used by entries and the tree.
+    size_t Memory_Usage() const;
+
+    // Save the entries and tree to a cache file, or load them again.  Objects
+    // are not saved; Load takes them from expected, which lists the entries
+    // the hierarchy was built from in any order.  Load returns false, leaving
+    // the hierarchy empty, if the data is missing or damaged, or if its
+    // entries are not exactly the expected ones.
+    void Save(Cache_Writer& out) const;
+    bool Load(Cache_Reader& in,const std::vector<Entry>& expected);
+
     // Return a list of candidates (indices into the entries list) whose
-    // bounding boxes intersect the ray.
+    // bounding boxes intersect the ray.  Candidates are listed in the order
+    // the ray reaches them, nearest first.
     void Intersection_Candidates(const Ray& ray, std::vector<int>& candidates) const;
+
+    // Return the index of the entry with the closest intersection along with
+    // the Hit, or -1 if nothing is intersected.  Children are visited nearest
+    // first, and subtrees that start beyond the closest hit are skipped.  If
+    // they are not null, the number of tree nodes visited and entries tested
+    // are added to steps and tests.
+    std::pair<int,Hit> Closest_Intersection(const Ray& ray,
+        long long* steps=nullptr,long long* tests=nullptr) const;
+
+    // Packet version of Closest_Intersection.  For each ray k whose bit is set
+    // in mask, set entry[k] and hits[k] to the closest intersection.  The
+    // whole packet descends into a node if any of its rays enters the node's
+    // box before its own closest hit so far.
+    void Closest_Intersection(const Ray_Packet& packet,int mask,int entry[],
+        Hit hits[],long long* steps=nullptr,long long* tests=nullptr) const;
+
+    // Return whether any entry has an intersection in [small_t,t_max).  The
+    // traversal stops at the first one found, which is stored in occluder if
+    // that is not null.  Counters are as above.
+    bool Any_Intersection(const Ray& ray,double t_max,
+        long long* steps=nullptr,long long* tests=nullptr,
+        Occluder* occluder=nullptr) const;
+
+    // Index of the tree node corresponding to an entry, and the reverse.
+    int Leaf_Node(int entry) const {return entry+(int)entries.size()-1;}
+    int Leaf_Entry(int node) const {return node-((int)entries.size()-1);}
+    bool Is_Leaf(int node) const {return node>=(int)entries.size()-1;}
+
+private:
+    // The boxes of the entries while the tree is built.  Add_Entry appends to
+    // this and Reorder_Entries keeps it in the order of entries; Build_Tree
+    // then moves the boxes into the leaves and frees it.
+    std::vector<Box> entry_boxes;
+
+    // Sum of the surface areas of the nodes of tree, kept up to date by
+    // Build_Tree and Refit.
+    double area_sum=0;
+    void Compute_Area_Sum();
+    template<class Node> static double Area_Sum(const std::vector<Node>& boxes);
+    template<class Node> int Refit(std::vector<Node>& boxes,
+        const std::function<const Object*(int id)>& object);
+
+    // The traversals, for either type of tree.
+    template<class Node> void Intersection_Candidates(
+        const std::vector<Node>& boxes,const Ray& ray,
+        std::vector<int>& candidates) const;
+    template<class Node> std::pair<int,Hit> Closest_Intersection(
+        const std::vector<Node>& boxes,const Ray& ray,long long* steps,
+        long long* tests) const;
+    template<class Node> void Closest_Intersection(
+        const std::vector<Node>& boxes,const Ray_Packet& packet,int mask,
+        int entry[],Hit hits[],long long* steps,long long* tests) const;
+    template<class Node> bool Any_Intersection(const std::vector<Node>& boxes,
+        const Ray& ray,double t_max,long long* steps,long long* tests,
+        Occluder* occluder) const;
+    template<class Node> int Descend(const std::vector<Node>& boxes,
+        const Precomputed_Ray& ray,int node,double t_max,int nodes[4],
+        double t[4]) const;
+    void Reorder_Morton();
+    void Reorder_SAH(int node,const std::vector<int>& leaf_count,
+        std::vector<int>& order,int begin,int end,
+        std::vector<int>& reordered) const;
+    // Move entry order[i] (and its box) to position i.
+    void Apply_Order(const std::vector<int>& order);
 };
 #endif
@@ -21,5 +21,12 @@ public:
     virtual ~Light() = default;
 
     virtual vec3 Emitted_Light(const vec3& vector_to_light) const=0;
+
+    // The distance beyond which no channel of Emitted_Light exceeds cutoff,
+    // or infinity if the light does not fall off with distance.
+    virtual double Range(double /*cutoff*/) const
+    {
+        return std::numeric_limits<double>::infinity();
+    }
 };
 #endif
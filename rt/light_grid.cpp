@@ -0,0 +1,131 @@
+#include "light_grid.h"
+#include "light.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+// The grid has about this many cells per light of limited range, and at most
+// max_light_cells cells.
+static const double cells_per_light=8;
+static const int max_light_cells=1<<18;
+
+void Light_Grid::Initialize(const std::vector<const Light*>& scene_lights,
+    double cutoff)
+{
+    int n=scene_lights.size();
+    range_squared.assign(n,std::numeric_limits<double>::infinity());
+    positions.assign(n,vec3());
+    unlimited.clear();
+    domain.Make_Empty();
+    int limited=0;
+    for(int l=0;l<n;l++)
+    {
+        if(!scene_lights[l]) continue;
+        positions[l]=scene_lights[l]->position;
+        double range=scene_lights[l]->Range(cutoff);
+        if(range==std::numeric_limits<double>::infinity())
+        {
+            unlimited.push_back(l);
+            continue;
+        }
+        if(!(range>0))
+        {
+            range_squared[l]=-1; // reaches nothing
+            continue;
+        }
+        range_squared[l]=range*range;
+        domain.Include_Point(positions[l]-range);
+        domain.Include_Point(positions[l]+range);
+        limited++;
+    }
+
+    // Roughly cubical cells; the grid is never empty, even if no light has a
+    // limited range.
+    if(!limited)
+    {
+        domain.lo=domain.hi=vec3();
+        num_cells=ivec3(1,1,1);
+    }
+    else
+    {
+        vec3 size=domain.hi-domain.lo;
+        double cells=std::min(cells_per_light*limited,(double)max_light_cells);
+        double side=std::cbrt(size[0]*size[1]*size[2]/cells);
+        for(int i=0;i<3;i++)
+            num_cells[i]=side>0?std::max(1,std::min(64,(int)std::ceil(size[i]/side))):1;
+    }
+    dx=(domain.hi-domain.lo)/vec3(num_cells);
+
+    // Bin in two passes, as Acceleration::Grid does: count the lights of each
+    // cell, then fill them in.  Lights are visited in order, so each cell's
+    // list is sorted.
+    auto cells_of=[this](int l,ivec3& lo,ivec3& hi)
+    {
+        double range=std::sqrt(range_squared[l]);
+        for(int i=0;i<3;i++)
+        {
+            lo[i]=std::max(0,(int)std::floor((positions[l][i]-range-domain.lo[i])/dx[i]));
+            hi[i]=std::min(num_cells[i]-1,(int)std::floor((positions[l][i]+range-domain.lo[i])/dx[i]));
+        }
+    };
+    auto touches=[this](int l,const ivec3& c)
+    {
+        // Distance from the light to the nearest point of the cell
+        vec3 lo=domain.lo+vec3(c)*dx,hi=lo+dx;
+        vec3 nearest=componentwise_max(lo,componentwise_min(positions[l],hi));
+        return (nearest-positions[l]).magnitude_squared()<=range_squared[l];
+    };
+    auto bin=[&](auto add)
+    {
+        for(int l=0;l<n;l++)
+        {
+            if(!scene_lights[l] || range_squared[l]<0) continue;
+            bool all=range_squared[l]==std::numeric_limits<double>::infinity();
+            ivec3 lo(0,0,0),hi=num_cells-1;
+            if(!all) cells_of(l,lo,hi);
+            for(int k=lo[2];k<=hi[2];k++)
+                for(int j=lo[1];j<=hi[1];j++)
+                    for(int i=lo[0];i<=hi[0];i++)
+                        if(all || touches(l,ivec3(i,j,k)))
+                            add(Flat_Index(ivec3(i,j,k)),l);
+        }
+    };
+
+    int number_cells=num_cells[0]*num_cells[1]*num_cells[2];
+    cell_start.assign(number_cells+1,0);
+    bin([this](int c,int){cell_start[c+1]++;});
+    for(size_t c=1;c<cell_start.size();c++)
+        cell_start[c]+=cell_start[c-1];
+    std::vector<unsigned> next(cell_start.begin(),cell_start.end()-1);
+    lights.assign(cell_start.back(),0);
+    bin([this,&next](int c,int l){lights[next[c]++]=l;});
+}
+
+std::pair<const int*,const int*> Light_Grid::Candidates(const vec3& point) const
+{
+    ivec3 index;
+    for(int i=0;i<3;i++)
+    {
+        double x=(point[i]-domain.lo[i])/dx[i];
+        if(!(x>=0 && x<num_cells[i]))
+            return {unlimited.data(),unlimited.data()+unlimited.size()};
+        index[i]=(int)x;
+    }
+    int c=Flat_Index(index);
+    return {lights.data()+cell_start[c],lights.data()+cell_start[c+1]};
+}
+
+bool Light_Grid::Reaches(int light,const Box& box) const
+{
+    if(range_squared[light]==std::numeric_limits<double>::infinity()) return true;
+    vec3 nearest=componentwise_max(box.lo,componentwise_min(positions[light],box.hi));
+    return (nearest-positions[light]).magnitude_squared()<=range_squared[light];
+}
+
+void Light_Grid::Print_Statistics(std::ostream& out) const
+{
+    int number_cells=cell_start.size()-1;
+    out<<"light grid: "<<num_cells[0]<<"x"<<num_cells[1]<<"x"<<num_cells[2]
+       <<"; lights/cell: "<<(double)lights.size()/number_cells
+       <<"; unlimited lights: "<<unlimited.size()<<std::endl;
+}
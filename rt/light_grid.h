@@ -0,0 +1,63 @@
+#ifndef __LIGHT_GRID_H__
+#define __LIGHT_GRID_H__
+
+#include "box.h"
+#include "vec.h"
+#include <iosfwd>
+#include <vector>
+
+class Light;
+
+/*
+  Culls lights that are too far from a point to visibly light it (the
+  --light-cutoff commandline option).  Each light reaches a sphere whose
+  radius is its Light::Range for the cutoff.  The grid covers the bounding box
+  of those spheres, and each cell lists the lights whose spheres touch it,
+  in increasing order, so that a surface point is only shaded by the lights
+  of its cell that reach it.  Lights of unlimited range are listed in every
+  cell and are also returned for points outside the grid.
+*/
+class Light_Grid
+{
+    Box domain;
+    ivec3 num_cells;
+    vec3 dx;
+
+    // The lights of cell c are lights[cell_start[c]] to
+    // lights[cell_start[c+1]-1].  Lights of unlimited range are also kept in
+    // unlimited, for points outside the grid.
+    std::vector<unsigned> cell_start;
+    std::vector<int> lights;
+    std::vector<int> unlimited;
+
+    // Per light, the square of its range and its position.
+    std::vector<double> range_squared;
+    std::vector<vec3> positions;
+
+    int Flat_Index(const ivec3& i) const
+    {
+        return (i[2]*num_cells[1]+i[1])*num_cells[0]+i[0];
+    }
+
+public:
+    // Index the lights for the given cutoff, which must be positive.
+    void Initialize(const std::vector<const Light*>& scene_lights,double cutoff);
+
+    bool Empty() const {return cell_start.empty();}
+
+    // The lights that may reach point, as indices into the scene lights in
+    // increasing order.  Test each with Reaches.
+    std::pair<const int*,const int*> Candidates(const vec3& point) const;
+
+    // Return whether light reaches point.
+    bool Reaches(int light,const vec3& point) const
+    {
+        return (positions[light]-point).magnitude_squared()<=range_squared[light];
+    }
+
+    // Return whether light may reach a point of box.
+    bool Reaches(int light,const Box& box) const;
+
+    void Print_Statistics(std::ostream& out) const;
+};
+#endif
@@ -2,9 +2,15 @@
 #include "object.h"
 #include "parse.h"
 #include "render_world.h"
+#include <chrono>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <getopt.h>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <sys/inotify.h>
 #include <unistd.h>
 
 /*
@@ -50,22 +56,323 @@
   and debugging the acceleration structure.
 
   The -z flag changes the resolution of the acceleration structure.  This is
-  useful for testing correctness, runtime performance, and scaling.
+  useful for testing correctness, runtime performance, and scaling.  By
+  default the grid resolution is chosen from the number of primitives and the
+  shape of the scene.
+
+  The -a flag selects the acceleration structure: "grid" (the default) for
+  the uniform grid, "hgrid" for a grid whose overloaded cells are subdivided
+  by grids of their own, "bvh" for the bounding volume hierarchy built with the
+  surface area heuristic, or "lbvh" for the same hierarchy built from a
+  parallel Morton code sort.  The hierarchy copes better with scenes whose
+  primitives vary greatly in size.  The Morton build is much faster for very
+  large meshes at the cost of a somewhat slower traversal.
+
+  The -l flag enables two-level acceleration.  Each mesh builds its own
+  hierarchy over its triangles, and the structure selected with -a only
+  holds whole objects.  A mesh used by several shaded objects is only built
+  once.  The leaves of a mesh hierarchy hold four nearby triangles, which
+  are tested against a ray at once.
+
+  The -p flag traces primary rays in packets of four (2x2 pixel blocks)
+  through the hierarchy, using SIMD box, sphere and triangle tests.
+
+  The -v flag prints statistics about the acceleration structure (build time
+  and the average traversal cost per ray) after rendering, and how many
+  shadow rays were answered by the occluder cache.  Each thread remembers,
+  for every light, the last primitive that blocked a shadow ray toward it,
+  and tests that primitive before searching the acceleration structure.
+
+  The -c flag names a directory in which parsed meshes and built
+  acceleration structures are cached.  Later runs over the same meshes with
+  the same options load them from there instead of parsing and building
+  them again.  See cache.h.
+
+  The -n flag renders a sequence of frames, such as an animation.  The input
+  and output file names are then printf patterns that are given the frame
+  number, counting from 0.  For example, -n 10 -i frame%02d.txt -o
+  frame%02d.png renders frame00.txt through frame09.txt.  When consecutive
+  frames contain the same objects, the hierarchy (-a bvh or lbvh) of the
+  previous frame is refitted to the moved primitives instead of rebuilt, and
+  so are the hierarchies of meshes (-l) whose triangles are unchanged.  Each
+  frame is still parsed, and its meshes loaded, from scratch.
+  The -s, -x and -y flags are ignored for sequences.
+
+  The -F flag stores mesh vertices, texture coordinates and hierarchy boxes
+  in single precision, which roughly halves the memory used by very large
+  meshes.  Vertices are rounded to float when the mesh is loaded and boxes
+  are rounded outward, but all intersection arithmetic is still done in
+  double precision.  The per-triangle edge and normal data is then computed
+  on the fly instead of stored.  With -v, the memory used by each mesh is
+  printed.
+
+  The -j flag sets the number of threads used for rendering and for building
+  acceleration structures.  By default, one thread per hardware thread is
+  used.  The image is split into tiles, which idle threads steal from busy
+  ones.  The image does not depend on the number of threads.
+
+  The --time-budget flag renders progressively and stops after the given
+  number of milliseconds, measured from the start of rendering (including
+  building the acceleration structure).  A coarse pass traces one pixel per
+  16x16 block, and each further pass doubles the resolution.  Whatever has
+  been refined when time runs out is saved; the coarse pass is always
+  finished, so the image is never incomplete.  With enough time, the image
+  is identical to one rendered without a budget.
+
+  The -A flag enables adaptive anti-aliasing with at most the given number of
+  samples per pixel.  Every pixel is first rendered with one sample.  Pixels
+  on edges, where a neighbor's color differs noticeably or its primary ray
+  hit another object or triangle, then get a grid of jittered extra samples,
+  as many as the limit allows counting the first (-A 2 gives 1 extra sample,
+  -A 3 a 2x1 grid, -A 5 a 2x2 grid, -A 7 a 3x2 grid and -A 10 a 3x3 grid).
+  Other pixels cost no more than without anti-aliasing.
+
+  The -w flag renders with the wavefront renderer, which traces all rays of
+  one recursion depth together, sorted by origin and direction, rather than
+  following each pixel's reflections and refractions depth first.  The
+  image is identical.  See wavefront.cpp.  It is not used for progressive
+  rendering (--time-budget) or anti-aliasing samples.
+
+  The -t flag stops tracing reflection and refraction rays whose color would
+  contribute less than the given fraction to the pixel, such as reflections
+  off a surface with reflectivity near 0 or refractions through one with
+  opacity near 1.  The fraction (the path throughput) is the product of the
+  weights with which each shader along the path mixes in the color seen
+  along the ray.  With --roulette, such rays are instead traced with
+  probability throughput/threshold and their color is scaled up to
+  compensate, which keeps the image correct on average at the cost of some
+  noise.  The choice only depends on the ray, so the image is the same from
+  run to run.  By default every ray is traced.
+
+  The --light-cutoff flag skips point lights whose emitted light at a
+  surface point is at most the given intensity in every channel, so that
+  scenes with many small lights only pay for the lights near each point.
+  Phong shading adds at most twice that much per light (once for diffuse and
+  once for specular) for material colors up to 1, so with a cutoff of 0.0005
+  each skipped light changes a channel by less than half of an 8 bit color
+  step.  Many skipped lights can still add up to a visible darkening, so
+  scenes with hundreds of lights around each point need a smaller cutoff.
+  The lights are binned into a grid by the sphere that each one reaches (see
+  light_grid.h).  By default every light shades every point.
+
+  The -g flag saves the first hit of every pixel (the object, the hit, its
+  position and its normal) in the cache directory given with -c, which is
+  required.  A later run with -g over the same objects, image size and
+  camera loads this G-buffer and shades each pixel from it, skipping the
+  primary rays.  Shaders, colors and lights may change between the runs,
+  including which shader an object uses, so lighting and materials can be
+  tweaked at the cost of shading alone.  The image is identical to a full
+  render.  The run that records the G-buffer does not use packets (-p) or
+  the wavefront renderer (-w), and nothing is recorded with --time-budget.
+
+  The -W flag renders the scene and then watches the test file, rendering
+  it again into the output file each time it is saved, until interrupted.
+  Every tile of the image records the shaders of the surfaces that its rays
+  hit and the region of its points lit by Phong shading.  An edit that only
+  changes shaders, colors or lights is compared definition by definition
+  with the previous parse, and only the tiles that used a changed shader, or
+  have lit points that a changed light can reach, are rendered again, with
+  the objects and the acceleration structure of the previous parse.  A
+  changed shader includes the shaders and colors it uses.  With
+  --light-cutoff, a changed light only reaches the points within its old or
+  new range; otherwise it reaches every lit point.  Any other edit (objects,
+  including the contents of their mesh files, the camera, the ambient
+  light, which shader an object uses, shadows or the recursion depth)
+  renders the whole image again.  The result is always identical to a full
+  render.  Only the test file is watched, so edits to a mesh file are seen
+  the next time it is saved.  If the saved file does not parse, the error is
+  printed and the last image is kept.  Watching does not use -A, -g, -w or
+  --time-budget.
+
+  The --coordinator and --worker flags render the image across processes,
+  on one machine or several.  The coordinator listens at the given address
+  and hands out rows of tiles to the workers that connect to it, which
+  render them against their own parse of the test file and send back the
+  pixels.  An address is a Unix domain socket path (with a '/' or a leading
+  "unix:") or host:port for TCP; the coordinator listens on every interface
+  if the host is left out.  --local-workers starts that many workers on
+  this machine along with the coordinator.  Workers must run the same build
+  with the same test file and the same options that change the image (-F,
+  -t, --roulette and --light-cutoff); others are turned away.  The rows of
+  a worker that disconnects go to the other workers, and the coordinator
+  waits for new workers if none are left.  The image is identical to a
+  local render.  Distributed rendering does not use -A, -g, -w or
+  --time-budget.  See distributed.cpp.
  */
 
 // Indicates that we are debugging one pixel; can be accessed everywhere.
-bool Debug_Scope::enable=false;
-int Debug_Scope::level=0;
+thread_local bool Debug_Scope::enable=false;
+thread_local int Debug_Scope::level=0;
 bool enable_acceleration=true;
-int acceleration_grid_size=40;
+int acceleration_grid_size=0;
+Acceleration_Type acceleration_type=grid_acceleration;
+Hierarchy_Builder hierarchy_builder=sah_builder;
+bool nested_grid=false;
+bool two_level_acceleration=false;
+bool enable_packets=false;
+bool print_statistics=false;
+const char* cache_directory=nullptr;
+bool single_precision=false;
+int number_threads=0;
+double time_budget=0;
+int antialias_samples=1;
+bool wavefront_rendering=false;
+double minimum_throughput=0;
+double light_cutoff=0;
+bool relighting=false;
+bool russian_roulette=false;
+bool watch_scene=false;
+const char* coordinator_address=nullptr;
+const char* worker_address=nullptr;
+int local_workers=0;
 
 void Usage(const char* exec)
 {
-    std::cerr<<"Usage: "<<exec<<" -i <test-file> [ -s <solution-file> ] [ -f <stats-file> ] [ -o <output-file> ] [ -x <debug-x-coord> -y <debug-y-coord> ] [ -h ]  [ -z <resolution> ] "<<std::endl;
+    std::cerr<<"Usage: "<<exec<<" -i <test-file> [ -s <solution-file> ] [ -f <stats-file> ] [ -o <output-file> ] [ -x <debug-x-coord> -y <debug-y-coord> ] [ -h ]  [ -z <resolution> ] [ -a grid|hgrid|bvh|lbvh ] [ -l ] [ -p ] [ -v ] [ -c <cache-directory> ] [ -n <frames> ] [ -F ] [ -j <threads> ] [ --time-budget <milliseconds> ] [ -A <samples> ] [ -w ] [ -t <throughput> ] [ --roulette ] [ --light-cutoff <intensity> ] [ -g ] [ -W ] [ --coordinator <address> [ --local-workers <n> ] | --worker <address> ] "<<std::endl;
     exit(1);
 }
 
+// Commandline options that only have a long form
+enum {time_budget_option=256,roulette_option,light_cutoff_option,
+    coordinator_option,worker_option,local_workers_option};
+static const option long_options[]=
+{
+    {"time-budget",required_argument,nullptr,time_budget_option},
+    {"roulette",no_argument,nullptr,roulette_option},
+    {"light-cutoff",required_argument,nullptr,light_cutoff_option},
+    {"coordinator",required_argument,nullptr,coordinator_option},
+    {"worker",required_argument,nullptr,worker_option},
+    {"local-workers",required_argument,nullptr,local_workers_option},
+    {nullptr,0,nullptr,0}
+};
+
 void Setup_Parsing(Parse& parse);
+void Run_Coordinator(Render_World& render_world,const char* address,int local_workers);
+void Run_Worker(Render_World& render_world,const char* address);
+
+// Parse the scene in input_file.  Errors are printed and return null.
+static std::unique_ptr<Render_World> Parse_Scene(const char* input_file)
+{
+    auto render_world = std::make_unique<Render_World>();
+    Parse parse;
+    Setup_Parsing(parse);
+    std::ifstream fin(input_file);
+    if(!fin)
+    {
+        std::cerr<<"Error: Failed to open file "<<input_file<<std::endl;
+        return nullptr;
+    }
+    try
+    {
+        parse.Parse_Input(*render_world,fin);
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr<<"Error: "<<input_file<<": "<<e.what()<<std::endl;
+        return nullptr;
+    }
+    return render_world;
+}
+
+// Render the scene in input_file, then render it again each time the file is
+// saved (the -W option).  Editors often save by writing a new file and
+// renaming it over the old one, so the directory is watched for files that
+// are written or moved into it.
+void Watch_Scene(const char* input_file,const char* output_file)
+{
+    std::string path(input_file), directory(".");
+    std::string::size_type slash=path.rfind('/');
+    if(slash!=std::string::npos) directory=path.substr(0,slash+1);
+    std::string name=path.substr(slash==std::string::npos ? 0 : slash+1);
+
+    int fd=inotify_init();
+    if(fd<0 || inotify_add_watch(fd,directory.c_str(),IN_CLOSE_WRITE|IN_MOVED_TO)<0)
+    {
+        perror("inotify");
+        exit(1);
+    }
+
+    auto render_world=Parse_Scene(input_file);
+    if(!render_world) exit(1);
+    render_world->Render();
+    Dump_png(render_world->camera.colors,render_world->camera.number_pixels[0],render_world->camera.number_pixels[1],output_file);
+    std::cout<<"rendered "<<output_file<<"; watching "<<input_file<<std::endl;
+
+    alignas(inotify_event) char events[4096];
+    while(1)
+    {
+        ssize_t length=read(fd,events,sizeof(events));
+        if(length<0)
+        {
+            perror("inotify");
+            exit(1);
+        }
+        bool saved=false;
+        for(char* p=events; p<events+length; p+=sizeof(inotify_event)+((inotify_event*)p)->len)
+        {
+            const inotify_event* event=(const inotify_event*)p;
+            if(event->len && name==event->name) saved=true;
+        }
+        if(!saved) continue;
+
+        auto start=std::chrono::steady_clock::now();
+        // A scene saved in the middle of an edit may not parse; the last
+        // image is kept until one that does is saved.
+        auto edited=Parse_Scene(input_file);
+        if(!edited)
+        {
+            std::cout<<"kept the last image"<<std::endl;
+            continue;
+        }
+        int tiles=render_world->Update(*edited);
+        if(tiles<0)
+        {
+            render_world=std::move(edited);
+            render_world->Render();
+        }
+        Dump_png(render_world->camera.colors,render_world->camera.number_pixels[0],render_world->camera.number_pixels[1],output_file);
+        double elapsed=std::chrono::duration<double,std::milli>(
+            std::chrono::steady_clock::now()-start).count();
+        std::cout<<"rendered ";
+        if(tiles<0) std::cout<<"all tiles";
+        else std::cout<<tiles<<" of "<<render_world->tile_dependencies.size()<<" tiles";
+        std::cout<<" in "<<elapsed<<" ms"<<std::endl;
+        if(print_statistics)
+            render_world->Print_Statistics(std::cout);
+    }
+}
+
+// Render frames 0 to frames-1 of a sequence (the -n option).  Each frame
+// reuses the acceleration structure and mesh hierarchies of the previous one
+// where possible.
+void Render_Sequence(const char* input_pattern,const char* output_pattern,
+    int frames)
+{
+    std::unique_ptr<Render_World> previous;
+    for(int frame=0; frame<frames; frame++)
+    {
+        char input_file[1024], output_file[1024];
+        snprintf(input_file,sizeof(input_file),input_pattern,frame);
+        snprintf(output_file,sizeof(output_file),output_pattern,frame);
+
+        auto render_world = Parse_Scene(input_file);
+        if(!render_world) exit(1);
+        render_world->Render(previous.get());
+
+        if(print_statistics && enable_acceleration)
+        {
+            std::cout<<"frame "<<frame<<": ";
+            render_world->acceleration.Print_Statistics(std::cout);
+        }
+        if(print_statistics)
+        {
+            std::cout<<"frame "<<frame<<": ";
+            render_world->Print_Statistics(std::cout);
+        }
+        Dump_png(render_world->camera.colors,render_world->camera.number_pixels[0],render_world->camera.number_pixels[1],output_file);
+        previous = std::move(render_world);
+    }
+}
 
 int main(int argc, char** argv)
 {
@@ -74,11 +381,12 @@ int main(int argc, char** argv)
     const char* output_file = "output.png";
     const char* statistics_file = 0;
     int test_x=-1, test_y=-1;
+    int frames=0;
 
     // Parse commandline options
     while(1)
     {
-        int opt = getopt(argc, argv, "s:i:o:f:x:y:hz:");
+        int opt = getopt_long(argc, argv, "s:i:o:f:x:y:hz:a:lpvc:n:Fj:A:wt:gW", long_options, nullptr);
         if(opt==-1) break;
         switch(opt)
         {
@@ -90,9 +398,54 @@ int main(int argc, char** argv)
             case 'y': test_y = atoi(optarg); break;
             case 'h': enable_acceleration=false; break;
             case 'z': acceleration_grid_size = atoi(optarg); break;
+            case 'a':
+                if(!strcmp(optarg,"grid")) acceleration_type=grid_acceleration;
+                else if(!strcmp(optarg,"hgrid"))
+                {
+                    acceleration_type=grid_acceleration;
+                    nested_grid=true;
+                }
+                else if(!strcmp(optarg,"bvh")) acceleration_type=hierarchy_acceleration;
+                else if(!strcmp(optarg,"lbvh"))
+                {
+                    acceleration_type=hierarchy_acceleration;
+                    hierarchy_builder=morton_builder;
+                }
+                else Usage(argv[0]);
+                break;
+            case 'l': two_level_acceleration=true; break;
+            case 'p': enable_packets=true; break;
+            case 'v': print_statistics=true; break;
+            case 'c': cache_directory=optarg; break;
+            case 'n': frames=atoi(optarg); break;
+            case 'F': single_precision=true; break;
+            case 'j': number_threads=atoi(optarg); break;
+            case 'A': antialias_samples=atoi(optarg); break;
+            case 'w': wavefront_rendering=true; break;
+            case 't': minimum_throughput=atof(optarg); break;
+            case 'g': relighting=true; break;
+            case 'W': watch_scene=true; break;
+            case time_budget_option: time_budget=atof(optarg); break;
+            case roulette_option: russian_roulette=true; break;
+            case light_cutoff_option: light_cutoff=atof(optarg); break;
+            case coordinator_option: coordinator_address=optarg; break;
+            case worker_option: worker_address=optarg; break;
+            case local_workers_option: local_workers=atoi(optarg); break;
         }
     }
-    if(!input_file) Usage(argv[0]);
+    if(!input_file || (relighting && !cache_directory)) Usage(argv[0]);
+    if((coordinator_address && worker_address) || (local_workers && !coordinator_address))
+        Usage(argv[0]);
+    if(frames>0)
+    {
+        Render_Sequence(input_file,output_file,frames);
+        return 0;
+    }
+    if(watch_scene)
+    {
+        Watch_Scene(input_file,output_file);
+        return 0;
+    }
 
     Render_World render_world;
     
@@ -107,10 +460,27 @@ int main(int argc, char** argv)
         exit(1);
     }
     assert(fin);
-    parse.Parse_Input(render_world,fin);
+    try
+    {
+        parse.Parse_Input(render_world,fin);
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr<<"Error: "<<input_file<<": "<<e.what()<<std::endl;
+        exit(1);
+    }
     
-    // Render the image
-    render_world.Render();
+    // Render the image, or the parts that the coordinator hands out
+    if(worker_address)
+    {
+        render_world.Prepare();
+        Run_Worker(render_world,worker_address);
+        return 0;
+    }
+    if(coordinator_address)
+        Run_Coordinator(render_world,coordinator_address,local_workers);
+    else
+        render_world.Render();
 
     // For debugging.  Render only the pixel specified on the commandline.
     // Useful for printing out information about a single pixel.
@@ -122,12 +492,18 @@ int main(int argc, char** argv)
         std::cout<<"debug pixel: -x "<<test_x<<" -y "<<test_y<<std::endl;
 
         // Render just the pixel we are debugging
+        if(coordinator_address) render_world.Prepare();
         render_world.Render_Pixel(ivec2(test_x,test_y));
 
         // Mark the pixel we are testing green in the output image.
         render_world.camera.Set_Pixel(ivec2(test_x,test_y),0x00ff00ff);
     }
 
+    if(print_statistics && enable_acceleration && !coordinator_address)
+        render_world.acceleration.Print_Statistics(std::cout);
+    if(print_statistics && !coordinator_address)
+        render_world.Print_Statistics(std::cout);
+
     // Save the rendered image to disk
     Dump_png(render_world.camera.colors,render_world.camera.number_pixels[0],render_world.camera.number_pixels[1],output_file);
     
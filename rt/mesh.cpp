@@ -1,29 +1,349 @@
 #include "mesh.h"
+#include "cache.h"
 #include <fstream>
+#include <sstream>
 #include <limits>
 #include <string>
 #include <algorithm>
 #include <cassert>
+#include <stdexcept>
 
 static const double weight_tolerance = 1e-4;
 
+extern bool enable_acceleration;
+extern bool two_level_acceleration;
+extern Hierarchy_Builder hierarchy_builder;
+extern bool single_precision;
+extern bool print_statistics;
+
 Mesh::Mesh(const Parse* parse, std::istream& in)
 {
     std::string file;
     in >> name >> file;
     Read_Obj(file.c_str());
+    Cache_Key key;
+    key.Add(vertices);
+    key.Add(triangles);
+    key.Add(uvs);
+    key.Add(triangle_texture_index);
+    content_key = key.value;
+    Precompute_Triangles();
+}
+
+void Mesh::Prepare(Object* previous)
+{
+    bool refit = false;
+    if (enable_acceleration && two_level_acceleration)
+    {
+        Mesh* previous_mesh = dynamic_cast<Mesh*>(previous);
+        refit = previous_mesh && Refit_Hierarchy(*previous_mesh);
+        if (!refit) Build_Hierarchy();
+    }
+
+    if (print_statistics)
+    {
+        std::cout << "mesh " << name << ": " << triangles.size() << " triangles; memory: "
+                  << Memory_Usage(false) / 1024 << " KiB";
+        if (single_precision)
+            std::cout << " (" << (Memory_Usage(true) - Memory_Usage(false)) / 1024
+                      << " KiB saved by single precision)";
+        if (!hierarchy.Empty())
+            std::cout << "; hierarchy cost: " << hierarchy.Cost();
+        if (refit)
+            std::cout << " (refitted)";
+        std::cout << std::endl;
+    }
+}
+
+// In single precision, the vertices and texture coordinates are rounded to
+// float and the blocks are not stored at all; the triangle data is instead
+// computed (in double precision) from the rounded vertices as it is needed.
+void Mesh::Precompute_Triangles()
+{
+    if (single_precision)
+    {
+        float_vertices.resize(vertices.size());
+        for (size_t i = 0; i < vertices.size(); i++)
+            float_vertices[i] = fvec3(vertices[i]);
+        float_uvs.resize(uvs.size());
+        for (size_t i = 0; i < uvs.size(); i++)
+            float_uvs[i] = fvec2(uvs[i]);
+        std::vector<vec3>().swap(vertices);
+        std::vector<vec2>().swap(uvs);
+    }
+    Fill_Blocks();
+}
+
+void Mesh::Fill_Blocks()
+{
+    triangle_blocks.clear();
+    if (single_precision) return;
+    std::vector<Triangle_Block> blocks(Number_Blocks());
+    for (int b = 0; b < (int)blocks.size(); b++)
+        Fill_Block(b, blocks[b]);
+    triangle_blocks.swap(blocks);
+}
+
+void Mesh::Reorder_Triangles(const std::vector<int>& order)
+{
+    std::vector<ivec3> reordered(order.size()), reordered_texture_index;
+    std::vector<int> original(order.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        reordered[i] = triangles[order[i]];
+        original[i] = triangle_order.empty() ? order[i] : triangle_order[order[i]];
+    }
+    if (!triangle_texture_index.empty())
+    {
+        // Triangles past the end of triangle_texture_index have no texture
+        // coordinates; once reordered, they are marked with -1 instead.
+        reordered_texture_index.resize(order.size(), ivec3(-1, -1, -1));
+        for (size_t i = 0; i < order.size(); i++)
+            if (order[i] < (int)triangle_texture_index.size())
+                reordered_texture_index[i] = triangle_texture_index[order[i]];
+    }
+    triangles.swap(reordered);
+    triangle_texture_index.swap(reordered_texture_index);
+    triangle_order.swap(original);
+    block_parts = true;
+    num_parts = Number_Blocks();
+    Fill_Blocks();
+}
+
+void Mesh::Compute_Triangle(int tri, vec3& A, vec3& v, vec3& w, vec3& normal) const
+{
+    ivec3 e = triangles[tri];
+    A = Vertex(e[0]);
+    v = Vertex(e[1]) - A;
+    w = Vertex(e[2]) - A;
+    normal = cross(v, w);
+}
+
+void Mesh::Fill_Block(int block, Triangle_Block& b) const
+{
+    b = Triangle_Block();
+    for (int k = 0; k < 4 && 4 * block + k < (int)triangles.size(); k++)
+    {
+        vec3 A, v, w, normal;
+        Compute_Triangle(4 * block + k, A, v, w, normal);
+        for (int i = 0; i < 3; i++)
+        {
+            b.A[i][k] = A[i];
+            b.v[i][k] = v[i];
+            b.w[i][k] = w[i];
+            b.normal[i][k] = normal[i];
+        }
+    }
+}
+
+static vec3 Lane(const vec3x4& x, int k)
+{
+    return vec3(x[0][k], x[1][k], x[2][k]);
+}
+
+void Mesh::Triangle_Data(int tri, vec3& A, vec3& v, vec3& w, vec3& normal) const
+{
+    if (triangle_blocks.empty())
+    {
+        Compute_Triangle(tri, A, v, w, normal);
+        return;
+    }
+    const Triangle_Block& b = triangle_blocks[tri / 4];
+    int k = tri % 4;
+    A = Lane(b.A, k);
+    v = Lane(b.v, k);
+    w = Lane(b.w, k);
+    normal = Lane(b.normal, k);
+}
+
+const Triangle_Block& Mesh::Block(int block, Triangle_Block& scratch) const
+{
+    if (!triangle_blocks.empty()) return triangle_blocks[block];
+    Fill_Block(block, scratch);
+    return scratch;
+}
+
+// Bytes used by the geometry and the bottom-level hierarchy.  If as_double,
+// instead return what the same mesh takes in double precision.
+size_t Mesh::Memory_Usage(bool as_double) const
+{
+    size_t vertex_count = vertices.size() + float_vertices.size();
+    size_t uv_count = uvs.size() + float_uvs.size();
+    size_t node_count = hierarchy.tree.size() + hierarchy.float_tree.size();
+    size_t bytes = (triangles.size() + triangle_texture_index.size()) * sizeof(ivec3)
+        + triangle_order.size() * sizeof(int) + hierarchy.entries.size() * sizeof(Entry);
+    if (as_double)
+        return bytes + vertex_count * sizeof(vec3) + uv_count * sizeof(vec2)
+            + (triangles.size() + 3) / 4 * sizeof(Triangle_Block)
+            + node_count * sizeof(Box);
+    return bytes + vertices.size() * sizeof(vec3) + float_vertices.size() * sizeof(fvec3)
+        + uvs.size() * sizeof(vec2) + float_uvs.size() * sizeof(fvec2)
+        + triangle_blocks.size() * sizeof(Triangle_Block)
+        + hierarchy.Memory_Usage() - hierarchy.entries.size() * sizeof(Entry);
+}
+
+// Return whether order lists each of 0, ..., n-1 exactly once.
+static bool Is_Permutation(const std::vector<int>& order, size_t n)
+{
+    if (order.size() != n) return false;
+    std::vector<bool> seen(n);
+    for (int i : order)
+    {
+        if (i < 0 || i >= (int)n || seen[i]) return false;
+        seen[i] = true;
+    }
+    return true;
+}
+
+void Mesh::Build_Hierarchy()
+{
+    Cache_Key key;
+    key.Add(cache_key);
+    key.Add(hierarchy_builder);
+    key.Add(weight_tol);
+    key.Add(single_precision);
+    Cache_Reader in("mesh-hierarchy", key.value);
+    std::vector<int> order;
+    std::vector<Entry> blocks(Number_Blocks());
+    for (int b = 0; b < Number_Blocks(); b++)
+        blocks[b] = {this, b, b};
+    if (triangle_order.empty() && in.Read(order) &&
+        Is_Permutation(order, triangles.size()) && hierarchy.Load(in, blocks))
+    {
+        Reorder_Triangles(order);
+        return;
+    }
+
+    // The triangles are put in the order of the leaves of a hierarchy over
+    // them, so that four consecutive triangles are close together, and the
+    // hierarchy is then built again over the blocks.
+    hierarchy.builder = hierarchy_builder;
+    hierarchy.single_precision = single_precision;
+    hierarchy.Clear_Entries(triangles.size());
+    for (int i = 0; i < (int)triangles.size(); i++)
+        hierarchy.Add_Entry(this, i, i, Triangles_Box(i, i + 1));
+    hierarchy.Reorder_Entries();
+    order.resize(triangles.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = hierarchy.entries[i].id;
+    Reorder_Triangles(order);
+
+    hierarchy.Clear_Entries(Number_Blocks());
+    for (int b = 0; b < Number_Blocks(); b++)
+        hierarchy.Add_Entry(this, b, b);
+    hierarchy.Reorder_Entries();
+    hierarchy.Build_Tree();
+
+    Cache_Writer out("mesh-hierarchy", key.value);
+    out.Write(triangle_order);
+    hierarchy.Save(out);
+}
+
+// Refitting keeps the order of the triangles, which only suits vertices that
+// move together, as in an animation.  The entry boxes are all recomputed, but
+// only the tree nodes above the blocks that moved are updated.
+bool Mesh::Refit_Hierarchy(Mesh& previous)
+{
+    const std::vector<int>& order = previous.triangle_order;
+    if (previous.hierarchy.Empty() ||
+        previous.hierarchy.single_precision != single_precision ||
+        !triangle_order.empty() || order.size() != triangles.size())
+        return false;
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        const ivec3& a = triangles[order[i]];
+        const ivec3& b = previous.triangles[i];
+        if (a[0] != b[0] || a[1] != b[1] || a[2] != b[2]) return false;
+    }
+    Reorder_Triangles(order);
+    hierarchy = std::move(previous.hierarchy);
+    hierarchy.Refit([this](int) { return this; });
+    if (hierarchy.Cost() <= Hierarchy::rebuild_threshold * hierarchy.build_cost)
+        return true;
+    hierarchy = Hierarchy();
+    Restore_Triangle_Order();
+    return false;
+}
+
+void Mesh::Restore_Triangle_Order()
+{
+    std::vector<ivec3> restored(triangles.size()), restored_texture_index;
+    for (size_t i = 0; i < triangle_order.size(); i++)
+        restored[triangle_order[i]] = triangles[i];
+    if (!triangle_texture_index.empty())
+    {
+        restored_texture_index.resize(triangle_texture_index.size());
+        for (size_t i = 0; i < triangle_order.size(); i++)
+            restored_texture_index[triangle_order[i]] = triangle_texture_index[i];
+    }
+    triangles.swap(restored);
+    triangle_texture_index.swap(restored_texture_index);
+    std::vector<int>().swap(triangle_order);
+    block_parts = false;
+    num_parts = triangles.size();
+    Fill_Blocks();
 }
 
 // Read in a mesh from an obj file. Populates the bounding box and registers
-// one part per triangle (by setting number_parts).
+// one part per triangle (by setting number_parts).  With caching enabled, the
+// parsed arrays are saved under a hash of the file contents, and later runs
+// load them instead of parsing the file again.
 void Mesh::Read_Obj(const char* file)
 {
-    std::ifstream fin(file);
+    std::ifstream fin(file, std::ios::binary);
     if (!fin)
+        throw std::runtime_error(std::string("cannot open ") + file);
+
+    if (!Cache_Enabled())
     {
-        exit(EXIT_FAILURE);
+        Parse_Obj(fin);
+        return;
     }
 
+    std::stringstream contents;
+    contents << fin.rdbuf();
+    Cache_Key key;
+    key.Add(contents.str());
+    cache_key = key.value;
+
+    Cache_Reader in("mesh", cache_key);
+    if (in.Read(vertices) && in.Read(triangles) && in.Read(uvs) &&
+        in.Read(triangle_texture_index) && Valid_Indices())
+    {
+        num_parts = triangles.size();
+        return;
+    }
+    vertices.clear();
+    triangles.clear();
+    uvs.clear();
+    triangle_texture_index.clear();
+
+    Parse_Obj(contents);
+    Cache_Writer out("mesh", cache_key);
+    out.Write(vertices);
+    out.Write(triangles);
+    out.Write(uvs);
+    out.Write(triangle_texture_index);
+}
+
+bool Mesh::Valid_Indices() const
+{
+    auto valid = [](const ivec3& e, size_t n)
+    {
+        for (int i = 0; i < 3; i++)
+            if (e[i] < 0 || e[i] >= (int)n) return false;
+        return true;
+    };
+    if (triangle_texture_index.size() > triangles.size()) return false;
+    for (const ivec3& e : triangles)
+        if (!valid(e, vertices.size())) return false;
+    for (const ivec3& t : triangle_texture_index)
+        if (!valid(t, uvs.size())) return false;
+    return true;
+}
+
+void Mesh::Parse_Obj(std::istream& fin)
+{
     std::string line;
     ivec3 e, t;
     vec3 v;
@@ -66,18 +386,20 @@ Hit Mesh::Intersection(const Ray& ray, int part) const
 
     if (part >= 0)
     {
-        closest_hit = Intersect_Triangle(ray, part);
+        closest_hit = block_parts ? Intersect_Block(ray, part) : Intersect_Triangle(ray, part);
+    }
+    else if (!hierarchy.Empty())
+    {
+        auto [entry, hit] = hierarchy.Closest_Intersection(ray);
+        if (entry >= 0) closest_hit = hit;
     }
     else
     {
-        // Check all triangles
-        for (int i = 0; i < (int)triangles.size(); i++)
+        // Check all triangles, four at a time
+        for (int b = 0; b < Number_Blocks(); b++)
         {
-            Hit hit = Intersect_Triangle(ray, i);
-            if (hit.dist >= small_t && hit.dist < closest_hit.dist)
-            {
-                closest_hit = hit;
-            }
+            Hit hit = Intersect_Block(ray, b);
+            if (hit.Valid() && hit.dist < closest_hit.dist) closest_hit = hit;
         }
     }
 
@@ -89,49 +411,104 @@ Hit Mesh::Intersection(const Ray& ray, int part) const
     return closest_hit;
 }
 
+void Mesh::Packet_Intersection(const Ray_Packet& packet, int part,
+    int mask, Hit hits[]) const
+{
+    if (part >= 0 && !block_parts)
+    {
+        Intersect_Triangle(packet, part, mask, hits);
+        return;
+    }
+
+    int entries[packet_size];
+    if (part < 0 && !hierarchy.Empty())
+    {
+        hierarchy.Closest_Intersection(packet, mask, entries, hits);
+    }
+    else
+    {
+        // Check all triangles, or those of one block
+        int begin = part < 0 ? 0 : 4 * part;
+        int end = part < 0 ? triangles.size() : std::min(begin + 4, (int)triangles.size());
+        Hit closest[packet_size], tri_hits[packet_size];
+        for (int k = 0; k < packet_size; k++)
+            closest[k].dist = std::numeric_limits<double>::infinity();
+        for (int i = begin; i < end; i++)
+        {
+            Intersect_Triangle(packet, i, mask, tri_hits);
+            for (int k = 0; k < packet_size; k++)
+                if ((mask & (1 << k)) && tri_hits[k].dist >= small_t && tri_hits[k].dist < closest[k].dist)
+                    closest[k] = tri_hits[k];
+        }
+        for (int k = 0; k < packet_size; k++)
+            if (mask & (1 << k)) hits[k] = closest[k];
+    }
+
+    for (int k = 0; k < packet_size; k++)
+        if ((mask & (1 << k)) && hits[k].dist == std::numeric_limits<double>::infinity())
+            hits[k].dist = -1;
+}
+
+bool Mesh::Any_Intersection(const Ray& ray, int part, double t_max, int* blocking_part) const
+{
+    auto blocks = [&](int tri)
+    {
+        Hit hit = Intersect_Triangle(ray, tri, false);
+        return hit.Valid() && hit.dist >= small_t && hit.dist < t_max;
+    };
+
+    if (part >= 0)
+        return block_parts ? Occluding_Triangle(ray, part, t_max) >= 0 : blocks(part);
+    if (!hierarchy.Empty())
+    {
+        Occluder occluder;
+        if (!hierarchy.Any_Intersection(ray, t_max, nullptr, nullptr, &occluder)) return false;
+        if (blocking_part) *blocking_part = occluder.part;
+        return true;
+    }
+    for (int b = 0; b < Number_Blocks(); b++)
+    {
+        int tri = Occluding_Triangle(ray, b, t_max);
+        if (tri >= 0)
+        {
+            if (blocking_part) *blocking_part = tri;
+            return true;
+        }
+    }
+    return false;
+}
+
 // Compute the normal direction for the triangle with index part.
 vec3 Mesh::Normal(const Ray& ray, const Hit& hit) const
 {
     assert(hit.triangle >= 0);
-
-    ivec3 e = triangles[hit.triangle];
-    vec3 A = vertices[e[0]];
-    vec3 B = vertices[e[1]];
-    vec3 C = vertices[e[2]];
-
-    vec3 normal = cross(B-A, C-A).normalized();
-    return normal;
+    vec3 A, v, w, normal;
+    Triangle_Data(hit.triangle, A, v, w, normal);
+    return normal.normalized();
 }
 
-Hit Mesh::Intersect_Triangle(const Ray& ray, int tri) const
+Hit Mesh::Intersect_Triangle(const Ray& ray, int tri, bool compute_uv) const
 {
     Hit hit;
     hit.triangle = -1;
     hit.dist = -1;
 
-    // Retrieve the triangle vertices
-    ivec3 e = triangles[tri];
-    vec3 A = vertices[e[0]];
-    vec3 B = vertices[e[1]];
-    vec3 C = vertices[e[2]];
-
-    // Compute the normal for the triangle
-    vec3 normal = cross(B - A, C - A);
+    // Retrieve the precomputed triangle data
+    vec3 A, v, w, normal;
+    Triangle_Data(tri, A, v, w, normal);
     double denominator = dot(normal, ray.direction);
 
     // Check if the ray is parallel to the triangle
     if (std::abs(denominator) < small_t) return hit;
 
     // Compute barycentric coordinates
-    vec3 v = B - A;
-    vec3 w = C - A;
     vec3 y = ray.endpoint - A;
     vec3 u = ray.direction;
 
     double beta = dot(cross(u, w), y) / dot(cross(u, w), v);
     double gamma = dot(cross(u, v), y) / dot(cross(u, v), w);
     double alpha = 1.0 - beta - gamma;
-    double t = -dot(cross(v, w), y) / dot(cross(v, w), u);
+    double t = -dot(normal, y) / dot(normal, u);
 
     // Pixel_Print("mesh M triangle ", tri, " intersected; weights: (", alpha, " ", beta, " ", gamma, "); dist ", t);
 
@@ -141,19 +518,109 @@ Hit Mesh::Intersect_Triangle(const Ray& ray, int tri) const
         hit.triangle = tri;
 
         // Compute interpolated texture coordinates
-        if (!triangle_texture_index.empty() && tri < (int)triangle_texture_index.size())
-        {
-            ivec3 tex_idx = triangle_texture_index[tri];
-            vec2 uvA = uvs[tex_idx[0]];
-            vec2 uvB = uvs[tex_idx[1]];
-            vec2 uvC = uvs[tex_idx[2]];
+        if (compute_uv)
+            hit.uv = Texture_Coordinates(tri, alpha, beta, gamma);
+    }
+
+    return hit;
+}
+
+// Test the ray against the four triangles of a block at once.  Returns a mask
+// of the lanes whose triangles are hit and sets the corresponding lanes of t
+// and the barycentric weights.  The operations are performed in the same
+// order as the single triangle version so that the results match exactly.
+int Mesh::Intersect_Triangles(const Ray& ray, int block, double4& t,
+    double4& alpha, double4& beta, double4& gamma) const
+{
+    Triangle_Block scratch;
+    const Triangle_Block& b = Block(block, scratch);
+    vec3x4 u = Splat(ray.direction);
+    vec3x4 y = Splat(ray.endpoint) - b.A;
+    double4 denominator = dot(b.normal, u);
+
+    vec3x4 uw = cross(u, b.w);
+    vec3x4 uv = cross(u, b.v);
+    beta = dot(uw, y) / dot(uw, b.v);
+    gamma = dot(uv, y) / dot(uv, b.w);
+    alpha = 1.0 - beta - gamma;
+    t = -dot(b.normal, y) / dot(b.normal, u);
+
+    return Lane_Mask(~((denominator < small_t) & (denominator > -small_t)) &
+        (alpha >= -weight_tolerance) & (beta >= -weight_tolerance) &
+        (gamma >= -weight_tolerance));
+}
+
+Hit Mesh::Intersect_Block(const Ray& ray, int block) const
+{
+    Hit hit;
+    hit.triangle = -1;
+    hit.dist = -1;
+    double4 t, alpha, beta, gamma;
+    int mask = Intersect_Triangles(ray, block, t, alpha, beta, gamma);
+    for (int k = 0; mask; k++, mask >>= 1)
+    {
+        if (!(mask & 1) || t[k] < small_t || (hit.Valid() && t[k] >= hit.dist)) continue;
+        int tri = 4 * block + k;
+        hit.dist = t[k];
+        hit.triangle = tri;
+        hit.uv = Texture_Coordinates(tri, alpha[k], beta[k], gamma[k]);
+    }
+    return hit;
+}
+
+int Mesh::Occluding_Triangle(const Ray& ray, int block, double t_max) const
+{
+    double4 t, alpha, beta, gamma;
+    int mask = Intersect_Triangles(ray, block, t, alpha, beta, gamma);
+    mask &= Lane_Mask((t >= small_t) & (t < t_max));
+    return mask ? 4 * block + __builtin_ctz(mask) : -1;
+}
+
+// Packet version of Intersect_Triangle.  The operations are performed in the
+// same order as the single ray version so that the results match exactly.
+void Mesh::Intersect_Triangle(const Ray_Packet& packet, int tri, int mask, Hit hits[]) const
+{
+    vec3 A, triangle_v, triangle_w, triangle_normal;
+    Triangle_Data(tri, A, triangle_v, triangle_w, triangle_normal);
+    vec3x4 normal = Splat(triangle_normal);
+    double4 denominator = dot(normal, packet.direction);
+
+    vec3x4 v = Splat(triangle_v);
+    vec3x4 w = Splat(triangle_w);
+    vec3x4 y = packet.endpoint - Splat(A);
+    const vec3x4& u = packet.direction;
+
+    double4 beta = dot(cross(u, w), y) / dot(cross(u, w), v);
+    double4 gamma = dot(cross(u, v), y) / dot(cross(u, v), w);
+    double4 alpha = 1.0 - beta - gamma;
+    double4 t = -dot(normal, y) / dot(normal, u);
 
-            hit.uv = alpha * uvA + beta * uvB + gamma * uvC;
-            // Pixel_Print("Computed UV: (", hit.uv[0], " ", hit.uv[1], ")");
+    for (int k = 0; k < packet_size; k++)
+    {
+        if (!(mask & (1 << k))) continue;
+        Hit& hit = hits[k];
+        hit = Hit();
+        if (std::abs(denominator[k]) < small_t) continue;
+        if (alpha[k] >= -weight_tolerance && beta[k] >= -weight_tolerance && gamma[k] >= -weight_tolerance)
+        {
+            hit.dist = t[k];
+            hit.triangle = tri;
+            hit.uv = Texture_Coordinates(tri, alpha[k], beta[k], gamma[k]);
         }
     }
+}
 
-    return hit;
+vec2 Mesh::Texture_Coordinates(int tri, double alpha, double beta, double gamma) const
+{
+    if (triangle_texture_index.empty() || tri >= (int)triangle_texture_index.size())
+        return {};
+
+    ivec3 tex_idx = triangle_texture_index[tri];
+    if (tex_idx[0] < 0) return {};
+    vec2 uvA = UV(tex_idx[0]);
+    vec2 uvB = UV(tex_idx[1]);
+    vec2 uvC = UV(tex_idx[2]);
+    return alpha * uvA + beta * uvB + gamma * uvC;
 }
 
 std::pair<Box, bool> Mesh::Bounding_Box(int part) const
@@ -162,15 +629,21 @@ std::pair<Box, bool> Mesh::Bounding_Box(int part) const
     {
         Box box;
         box.Make_Empty();
-        for (const auto& v : vertices)
-            box.Include_Point(v);
+        for (int i = 0; i < Number_Vertices(); i++)
+            box.Include_Point(Vertex(i));
         return {box, false};
     }
 
-    ivec3 e = triangles[part];
-    vec3 A = vertices[e[0]];
-    Box b = {A, A};
-    b.Include_Point(vertices[e[1]]);
-    b.Include_Point(vertices[e[2]]);
-    return {b, false};
+    if (!block_parts) return {Triangles_Box(part, part + 1), false};
+    return {Triangles_Box(4 * part, std::min(4 * part + 4, (int)triangles.size())), false};
+}
+
+Box Mesh::Triangles_Box(int begin, int end) const
+{
+    Box b;
+    b.Make_Empty();
+    for (int tri = begin; tri < end; tri++)
+        for (int i = 0; i < 3; i++)
+            b.Include_Point(Vertex(triangles[tri][i]));
+    return b;
 }
@@ -2,6 +2,8 @@
 #define __MESH_H__
 
 #include "object.h"
+#include "hierarchy.h"
+#include <cstdint>
 
 // Consider a hit to be inside a triange if all barycentric weights
 // satisfy weight>=-weight_tol
@@ -9,6 +11,21 @@ static const double weight_tol = 1e-4;
 
 class Parse;
 
+// Precomputed data for four consecutive triangles, with triangle 4*b+k of the
+// mesh in lane k of block b.  Each quantity of all four triangles is then a
+// single aligned load, which is what the four-wide triangle test needs, and
+// single triangle tests avoid gathering the vertices through triangles.  With
+// two-level acceleration (-l), the triangles are ordered so that those of a
+// block lie close together, and the blocks are the leaves of the bottom-level
+// hierarchy.
+struct Triangle_Block
+{
+    vec3x4 A; // first vertex
+    vec3x4 v; // B-A
+    vec3x4 w; // C-A
+    vec3x4 normal; // cross(v,w), not normalized
+};
+
 class Mesh : public Object
 {
     std::vector<vec3> vertices;
@@ -16,19 +33,114 @@ class Mesh : public Object
     std::vector<vec2> uvs; // indexed texture coordinates
     std::vector<ivec3> triangle_texture_index; // triangle index -> texture coordinate indices
 
+    // With single precision storage (-F), vertices and uvs are replaced by
+    // these after loading.  Use Vertex(...) and UV(...) to read either.
+    std::vector<fvec3> float_vertices;
+    std::vector<fvec2> float_uvs;
+
+    // Precomputed from vertices and triangles by Precompute_Triangles.  Lanes
+    // past the last triangle hold degenerate triangles, which are never hit.
+    // This is empty with single precision storage.
+    std::vector<Triangle_Block> triangle_blocks;
+
+    // Bottom-level hierarchy over the blocks of this mesh.  This is only
+    // built for two-level acceleration (-l), in which case the scene-level
+    // structure stores the whole mesh and Intersection(ray,-1) uses this.
+    Hierarchy hierarchy;
+
+    // Whether the parts of this mesh are its blocks rather than its
+    // triangles, which is the case once the bottom-level hierarchy is built.
+    bool block_parts = false;
+
+    // The index in the obj file of each triangle, once the triangles have
+    // been reordered for the bottom-level hierarchy.
+    std::vector<int> triangle_order;
+
+    // Hash of the obj file contents, used to look up cached data for this
+    // mesh.  This is only set when caching is enabled (-c).
+    uint64_t cache_key = 0;
 
 public:
     Mesh(const Parse* parse,std::istream& in);
     virtual ~Mesh() = default;
 
     virtual Hit Intersection(const Ray& ray, int part) const override;
+    virtual bool Any_Intersection(const Ray& ray, int part, double t_max,
+        int* blocking_part=nullptr) const override;
+    virtual void Packet_Intersection(const Ray_Packet& packet, int part,
+        int mask, Hit hits[]) const override;
     virtual vec3 Normal(const Ray& ray, const Hit& hit) const override;
     virtual std::pair<Box,bool> Bounding_Box(int part) const override;
 
     static constexpr const char* parse_name = "mesh";
 
+    // Build the bottom-level hierarchy (-l), or refit that of the previous
+    // frame, and print statistics (-v).
+    virtual void Prepare(Object* previous) override;
+
+    // (Re)build the bottom-level hierarchy from the current triangles, which
+    // are first reordered so that nearby triangles share blocks.
+    void Build_Hierarchy();
+
+    // Take over the bottom-level hierarchy and the triangle order of previous,
+    // a mesh with the same triangles, and refit it to the vertices of this
+    // mesh.  Returns false, leaving the hierarchy empty and the triangles in
+    // their original order, if the meshes differ or the refitted hierarchy is
+    // too much worse than a new one would be.
+    bool Refit_Hierarchy(Mesh& previous);
+
+    // Bytes used by the geometry and the bottom-level hierarchy.  If
+    // as_double, the bytes that the mesh would use in double precision.
+    size_t Memory_Usage(bool as_double) const;
+
 private:
-    Hit Intersect_Triangle(const Ray& ray, int tri) const;
+    int Number_Blocks() const
+    {
+        return (triangles.size() + 3) / 4;
+    }
+    int Number_Vertices() const
+    {
+        return vertices.size() + float_vertices.size();
+    }
+    vec3 Vertex(int i) const
+    {
+        return float_vertices.empty() ? vertices[i] : vec3(float_vertices[i]);
+    }
+    vec2 UV(int i) const
+    {
+        return float_uvs.empty() ? uvs[i] : vec2(float_uvs[i]);
+    }
+
+    // The first vertex, the edges B-A and C-A, and the normal cross(B-A,C-A)
+    // of a triangle, from triangle_blocks or computed from the vertices.
+    void Triangle_Data(int tri, vec3& A, vec3& v, vec3& w, vec3& normal) const;
+    void Compute_Triangle(int tri, vec3& A, vec3& v, vec3& w, vec3& normal) const;
+    void Fill_Block(int block, Triangle_Block& b) const;
+    const Triangle_Block& Block(int block, Triangle_Block& scratch) const;
+
+    void Precompute_Triangles();
+    void Fill_Blocks();
+    // Move triangle order[i] to position i, and make the parts blocks.
+    void Reorder_Triangles(const std::vector<int>& order);
+    // Undo Reorder_Triangles, putting the triangles back in the order of the
+    // obj file, and make the parts triangles again.
+    void Restore_Triangle_Order();
+    // The box of triangles [begin,end).
+    Box Triangles_Box(int begin, int end) const;
+    Hit Intersect_Triangle(const Ray& ray, int tri, bool compute_uv=true) const;
+    int Intersect_Triangles(const Ray& ray, int block, double4& t,
+        double4& alpha, double4& beta, double4& gamma) const;
+    // The closest hit at small_t or beyond among the triangles of a block,
+    // and the first triangle of a block hit in [small_t,t_max), or -1.
+    Hit Intersect_Block(const Ray& ray, int block) const;
+    int Occluding_Triangle(const Ray& ray, int block, double t_max) const;
+    void Intersect_Triangle(const Ray_Packet& packet, int tri, int mask, Hit hits[]) const;
+    vec2 Texture_Coordinates(int tri, double alpha, double beta, double gamma) const;
     void Read_Obj(const char* file);
+    void Parse_Obj(std::istream& in);
+
+    // Whether every triangle refers to existing vertices and texture
+    // coordinates, which is checked before trusting cached mesh data.
+    bool Valid_Indices() const;
 };
 #endif
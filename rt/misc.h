@@ -3,11 +3,13 @@
 
 #include "vec.h"
 #include "ray.h"
+#include <cstdint>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
 
-// Prints out a TODO message at most once.
+// Prints out a TODO message at most once.  The initialization of a local
+// static is thread-safe, so this holds even when rendering with threads.
 #define TODO {static std::ostream& todo=std::cout<<"TODO: "<<__FUNCTION__<<" in "<<__FILE__<<std::endl;(void)todo;}
 
 typedef unsigned int Pixel;
@@ -25,11 +27,12 @@ inline vec3 From_Pixel(Pixel color)
     return vec3(color >> 24, (color >> 16) & 0xff, (color >> 8) & 0xff) / 255.;
 }
 
-// Useful for creating indentation in pixel traces
+// Useful for creating indentation in pixel traces.  These are per thread,
+// so that only the thread rendering the debug pixel prints a trace.
 struct Debug_Scope
 {
-    static bool enable;
-    static int level;
+    static thread_local bool enable;
+    static thread_local int level;
 
     Debug_Scope() { level++; }
     ~Debug_Scope() { level--; }
@@ -79,4 +82,17 @@ inline int wrap(int i, int n)
     return k;
 }
 
+// Spread the low 21 bits of x out so that there are two zero bits between
+// each of them.  Used for Morton codes.
+inline uint64_t Spread_Bits(uint64_t x)
+{
+    x&=0x1fffff;
+    x=(x|x<<32)&0x1f00000000ffffULL;
+    x=(x|x<<16)&0x1f0000ff0000ffULL;
+    x=(x|x<<8)&0x100f00f00f00f00fULL;
+    x=(x|x<<4)&0x10c30c30c30c30c3ULL;
+    x=(x|x<<2)&0x1249249249249249ULL;
+    return x;
+}
+
 #endif // __MISC_H__
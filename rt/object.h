@@ -3,8 +3,10 @@
 
 #include "box.h"
 #include "hit.h"
+#include "ray_packet.h"
 #include "vec.h"
 #include "misc.h"
+#include <cstdint>
 #include <iosfwd>
 #include <vector>
 
@@ -23,6 +25,10 @@ public:
 
     int num_parts=1;
 
+    // Hash of what the object reads from other files, such as the triangles
+    // of a mesh, which its line in the scene file does not show.
+    uint64_t content_key=0;
+
     Object() = default;
     virtual ~Object() = default;
 
@@ -31,15 +37,55 @@ public:
     // intersections, return a Hit structure with dist<0.  If possible
     // also compute hit.uv.  If part>=0, intersect only against part of the
     // primitive.  This is only used for meshes, where part is the triangle
-    // index.  If part<0, intersect against all triangles.  For other
-    // primitives, part is ignored.
+    // index, or the index of a block of four triangles once the mesh has its
+    // own hierarchy (-l, see Mesh::block_parts).  Either way, hit.triangle is
+    // the triangle that was hit, which is what Normal uses, while
+    // blocking_part and the occluder cache hold parts, so blocks under -l.  If
+    // part<0, intersect against all triangles.  For other primitives, part is
+    // ignored.
     virtual Hit Intersection(const Ray& ray, int part) const=0;
 
+    // Return whether there is any intersection in the range [small_t,t_max).
+    // This is used for shadow rays, which only need a yes/no answer, so it
+    // may return at the first intersection found and need not compute uv.
+    // If part<0 and blocking_part is not null, primitives made of parts set
+    // *blocking_part to the part that was intersected.
+    virtual bool Any_Intersection(const Ray& ray, int part, double t_max,
+        int* /*blocking_part*/=nullptr) const
+    {
+        Hit hit=Intersection(ray,part);
+        return hit.Valid() && hit.dist>=small_t && hit.dist<t_max;
+    }
+
+    // Packet version of Intersection.  For each ray k of the packet whose bit
+    // is set in mask, set hits[k] as Intersection(packet.Get_Ray(k),part)
+    // would.  Other entries of hits are left alone.
+    virtual void Packet_Intersection(const Ray_Packet& packet, int part,
+        int mask, Hit hits[]) const
+    {
+        for(int k=0;k<packet_size;k++)
+            if(mask&(1<<k))
+                hits[k]=Intersection(packet.Get_Ray(k),part);
+    }
+
     // Return the normal at the intersection location.  Note that the
     // intersection location is ray.Point(hit.dist).
     virtual vec3 Normal(const Ray& ray, const Hit& hit) const=0;
 
     virtual std::pair<Box,bool> Bounding_Box(int part) const=0;
+
+    // Build what the object needs before rendering, such as the bottom-level
+    // hierarchy of a mesh (-l).  previous is the same object in the previous
+    // frame of a sequence (-n), or null, and what it built may be taken over.
+    virtual void Prepare(Object* /*previous*/) {}
+};
+
+// The primitive that blocked a shadow ray: an object and the part of it that
+// was intersected, or -1 if the whole object should be tested.
+struct Occluder
+{
+    const Object* object = nullptr;
+    int part = -1;
 };
 
 #endif
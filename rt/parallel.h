@@ -0,0 +1,126 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Set by the -j commandline option; 0 means one per hardware thread.
+extern int number_threads;
+
+// Number of threads used for parallel work such as rendering and building
+// hierarchies.
+inline int Number_Threads()
+{
+    if(number_threads>0) return number_threads;
+    return std::max(1u,std::thread::hardware_concurrency());
+}
+
+// Number of chunks to split n items into.  Ranges smaller than grain items
+// per thread are not worth the cost of starting threads.
+inline int Number_Chunks(int n,int grain=4096)
+{
+    return std::max(1,std::min(Number_Threads(),n/grain));
+}
+
+// Split [begin,end) into the given number of contiguous chunks and call
+// f(chunk,chunk_begin,chunk_end) for each one on its own thread.  The calling
+// thread handles chunk 0.  Chunk boundaries depend only on begin, end and
+// chunks, so separate calls with the same arguments split identically.
+template<class F>
+void Parallel_Chunks(int begin,int end,int chunks,F f)
+{
+    long long n=end-begin;
+    if(chunks<=1)
+    {
+        f(0,begin,end);
+        return;
+    }
+    std::vector<std::thread> threads;
+    for(int t=1;t<chunks;t++)
+        threads.emplace_back(f,t,begin+(int)(n*t/chunks),
+            begin+(int)(n*(t+1)/chunks));
+    f(0,begin,begin+(int)(n/chunks));
+    for(auto& t:threads) t.join();
+}
+
+// Call f(i) for each i in [begin,end), spread across threads.
+template<class F>
+void Parallel_For(int begin,int end,F f,int grain=4096)
+{
+    Parallel_Chunks(begin,end,Number_Chunks(end-begin,grain),
+        [&f](int,int b,int e){for(int i=b;i<e;i++) f(i);});
+}
+
+// Call f(i) for each task i in [0,n) on the given number of threads, for
+// tasks whose costs vary widely (such as image tiles).  Each thread starts
+// with a contiguous share of the tasks, which it takes from the front.  A
+// thread that runs out steals the back half of the tasks left to another
+// thread, so threads stay busy without contending on a single shared queue.
+template<class F>
+void Work_Stealing_For(int n,int threads,F f)
+{
+    threads=std::max(1,std::min(threads,n));
+    if(threads==1)
+    {
+        for(int i=0;i<n;i++) f(i);
+        return;
+    }
+
+    struct alignas(64) Queue
+    {
+        std::mutex lock;
+        int begin,end;
+    };
+    std::vector<Queue> queues(threads);
+    for(int t=0;t<threads;t++)
+    {
+        queues[t].begin=(long long)n*t/threads;
+        queues[t].end=(long long)n*(t+1)/threads;
+    }
+
+    auto work=[&queues,&f,threads](int t)
+    {
+        Queue& own=queues[t];
+        while(1)
+        {
+            int i;
+            {
+                std::lock_guard<std::mutex> guard(own.lock);
+                i=own.begin<own.end?own.begin++:-1;
+            }
+            if(i>=0)
+            {
+                f(i);
+                continue;
+            }
+
+            // Out of work; steal from the first other thread that has some.
+            bool stolen=false;
+            for(int k=1;k<threads && !stolen;k++)
+            {
+                Queue& victim=queues[(t+k)%threads];
+                int begin,end;
+                {
+                    std::lock_guard<std::mutex> guard(victim.lock);
+                    if(victim.begin>=victim.end) continue;
+                    end=victim.end;
+                    begin=victim.end-=(victim.end-victim.begin+1)/2;
+                }
+                std::lock_guard<std::mutex> guard(own.lock);
+                own.begin=begin;
+                own.end=end;
+                stolen=true;
+            }
+            if(!stolen) return;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for(int t=1;t<threads;t++) workers.emplace_back(work,t);
+    work(0);
+    for(auto& w:workers) w.join();
+}
+
+#endif
@@ -3,6 +3,7 @@
 #include <map>
 #include <sstream>
 #include <iostream>
+#include <stdexcept>
 #include <string>
 
 void Parse::Parse_Input(Render_World& render_world, std::istream& in)
@@ -25,24 +26,42 @@ void Parse::Parse_Input(Render_World& render_world, std::istream& in)
             auto o = it->second(this, ss);
             objects[o->name] = o;
             render_world.all_objects.push_back(o);
+            render_world.geometry_key.Add(line);
+            render_world.geometry_key.Add(o->content_key);
             // std::cout << "Parsed object: " << o->name << std::endl;
         }
         else if (auto it = parse_shaders.find(token); it != parse_shaders.end())
         {
+            Cache_Key key;
+            key.Add(line);
+            definition = &key;
             auto s = it->second(this, ss);
+            definition = nullptr;
             shaders[s->name] = s;
+            shader_keys[s->name] = key.value;
+            render_world.shader_keys[s->name] = key.value;
             render_world.all_shaders.push_back(s);
             // std::cout << "Parsed shader: " << s->name << std::endl;
         }
         else if (auto it = parse_lights.find(token); it != parse_lights.end())
         {
+            Cache_Key key;
+            key.Add(line);
+            definition = &key;
             render_world.lights.push_back(it->second(this, ss));
+            definition = nullptr;
+            render_world.light_keys.push_back(key.value);
             // std::cout << "Parsed light: " << token << std::endl;
         }
         else if (auto it = parse_colors.find(token); it != parse_colors.end())
         {
+            Cache_Key key;
+            key.Add(line);
+            definition = &key;
             auto c = it->second(this, ss);
+            definition = nullptr;
             colors[c->name] = c;
+            color_keys[c->name] = key.value;
             render_world.all_colors.push_back(c);
             // std::cout << "Parsed color: " << c->name << std::endl;
         }
@@ -51,27 +70,35 @@ void Parse::Parse_Input(Render_World& render_world, std::istream& in)
             auto o = Get_Object(ss);
             auto s = Get_Shader(ss);
             render_world.objects.push_back({o, s});
+            render_world.geometry_key.Add(o->name);
+            render_world.settings_key.Add(line);
             // std::cout << "Parsed shaded object: " << o->name << " with shader: " << s->name << std::endl;
         }
         else if (token == "background_shader")
         {
             render_world.background_shader = Get_Shader(ss);
+            render_world.settings_key.Add(line);
             // std::cout << "Parsed background shader." << std::endl;
         }
         else if (token == "ambient_light")
         {
+            render_world.settings_key.Add(line);
+            definition = &render_world.settings_key;
             render_world.ambient_color = Get_Color(ss);
+            definition = nullptr;
             ss >> render_world.ambient_intensity;
             // std::cout << "Parsed ambient light with intensity: " << render_world.ambient_intensity << std::endl;
         }
         else if (token == "size")
         {
             ss >> width >> height;
+            render_world.geometry_key.Add(line);
             // std::cout << "Parsed image size: " << width << "x" << height << std::endl;
         }
         else if (token == "camera")
         {
             ss >> u >> v >> w >> f0;
+            render_world.geometry_key.Add(line);
             render_world.camera.Position_And_Aim_Camera(u, v, w);
             render_world.camera.Focus_Camera(1, (double)width / height, f0 * (pi / 180));
             // std::cout << "Parsed camera with position: " << u << ", look at: " << v << ", field of view: " << f0 << std::endl;
@@ -79,19 +106,21 @@ void Parse::Parse_Input(Render_World& render_world, std::istream& in)
         else if (token == "enable_shadows")
         {
             ss >> render_world.enable_shadows;
+            render_world.settings_key.Add(line);
             // std::cout << "Shadows enabled: " << render_world.enable_shadows << std::endl;
         }
         else if (token == "recursion_depth_limit")
         {
             ss >> render_world.recursion_depth_limit;
+            render_world.settings_key.Add(line);
             // std::cout << "Recursion depth limit: " << render_world.recursion_depth_limit << std::endl;
         }
         else
         {
             // std::cout << "Failed to parse at: " << token << std::endl;
-            exit(EXIT_FAILURE);
+            throw std::runtime_error("unknown token: " + token);
         }
-        assert(ss);
+        if (!ss) throw std::runtime_error("failed to parse: " + line);
     }
     render_world.camera.Set_Resolution(ivec2(width, height));
 }
@@ -103,7 +132,8 @@ const Shader* Parse::Get_Shader(std::istream& in) const
     in>>token;
         
     auto it=shaders.find(token);
-    assert(it!=shaders.end());
+    if(it==shaders.end()) throw std::runtime_error("unknown shader: "+token);
+    if(definition) definition->Add(shader_keys.at(token));
     return it->second;
 }
 
@@ -113,7 +143,7 @@ const Object* Parse::Get_Object(std::istream& in) const
     in>>token;
 
     auto it=objects.find(token);
-    assert(it!=objects.end());
+    if(it==objects.end()) throw std::runtime_error("unknown object: "+token);
     return it->second;
 }
 
@@ -123,6 +153,7 @@ const Color* Parse::Get_Color(std::istream& in) const
     in>>token;
 
     auto it=colors.find(token);
-    assert(it!=colors.end());
+    if(it==colors.end()) throw std::runtime_error("unknown color: "+token);
+    if(definition) definition->Add(color_keys.at(token));
     return it->second;
 }
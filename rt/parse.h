@@ -2,6 +2,7 @@
 #define __PARSE_H__
 
 #include <map>
+#include "cache.h"
 #include "object.h"
 #include "light.h"
 #include "shader.h"
@@ -16,6 +17,15 @@ class Parse
     std::map<std::string,const Object*> objects;
     std::map<std::string,const Color*> colors;
 
+    // Hashes of the definitions of shaders and colors by name.  A definition
+    // is its line along with the definitions of the shaders and colors that
+    // it refers to, so that a change is seen by everything using it.  While
+    // a line is parsed, definition is the hash of that line, and Get_Shader
+    // and Get_Color add the definitions that they look up to it.
+    std::map<std::string,uint64_t> shader_keys;
+    std::map<std::string,uint64_t> color_keys;
+    mutable Cache_Key* definition=nullptr;
+
     // These are factories.  Given the class's parse name, construct an object
     // of the correct type.  The object's constructor will parse from the input
     // stream to initialize itself.  Note that the key is a string and the data
@@ -30,6 +40,8 @@ class Parse
     int width=-1;
     int height=-1;
 public:
+    // Parse a scene into render_world.  Errors in the scene, such as unknown
+    // keywords or names, are thrown as std::runtime_error.
     void Parse_Input(Render_World& render_world, std::istream& in);
 
     // Public access to the stored objects.
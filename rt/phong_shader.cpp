@@ -4,6 +4,7 @@
 #include "phong_shader.h"
 #include "ray.h"
 #include "render_world.h"
+#include <algorithm>
 
 Phong_Shader::Phong_Shader(const Parse* parse, std::istream& in)
 {
@@ -20,65 +21,106 @@ Phong_Shader::Phong_Shader(const Parse* parse, std::istream& in)
     }
 }
 
-vec3 Phong_Shader::Shade_Surface(const Render_World& render_world, const Ray& ray, const Hit& hit,
-                                 const vec3& intersection_point, const vec3& normal, int recursion_depth) const
+// Phong shading only casts a reflection ray past the recursion depth limit,
+// which Render_World::Cast_Ray never shades.
+void Phong_Shader::Secondary_Rays(const Render_World& render_world, const Ray& ray, const Hit& hit,
+                                  const vec3& intersection_point, const vec3& normal, int recursion_depth,
+                                  std::vector<Secondary_Ray>& rays) const
 {
-    // Pixel_Print("Shading surface at: ", Vec_To_String(intersection_point));
-    // Pixel_Print("Normal: ", Vec_To_String(normal));
+    if (recursion_depth <= render_world.recursion_depth_limit) return;
+    vec3 norm = normal.normalized();
+    if (norm.magnitude_squared() < 1e-6) return;
+    const double epsilon = 1e-4;
+    vec3 offset_point = intersection_point + norm * epsilon;
+    vec3 reflection_dir = - ray.direction + 2 * dot(ray.direction, norm) * norm;
+    rays.push_back({Ray(offset_point, reflection_dir.normalized()), 0.5}); // reflection_coefficient
+}
 
-    vec3 color(0, 0, 0);
+// Points are shaded a chunk at a time.  Each light is applied to every point
+// of the chunk before moving on to the next light, so that the light and the
+// material stay in cache, but each point accumulates its terms in the same
+// order as when shaded alone.
+void Phong_Shader::Combine(const Render_World& render_world, Shading_Point* const points[], int n,
+                           int recursion_depth) const
+{
+    // Single points come from recursive rendering, which should not pay for
+    // a whole chunk of per point state.
+    if (n == 1)
+    {
+        Combine_Chunk<1>(render_world, points, n, recursion_depth);
+        return;
+    }
+    for (int begin = 0; begin < n; begin += shading_chunk)
+        Combine_Chunk<shading_chunk>(render_world, points + begin,
+            std::min(shading_chunk, n - begin), recursion_depth);
+}
 
-    // Ensure the normal is normalized
-    vec3 norm = normal.normalized();
-    if (norm.magnitude_squared() < 1e-6)
+template<int chunk>
+void Phong_Shader::Combine_Chunk(const Render_World& render_world, Shading_Point* const points[], int n,
+                                 int recursion_depth) const
+{
+    // Points with invalid normals are left black
+    int valid[chunk] = {};
+    vec3 norm[chunk];
+    vec2 uv[chunk];
+    int m = 0;
+    for (int i = 0; i < n; i++)
     {
-        return color; // Return black for invalid normals
+        // Pixel_Print("Shading surface at: ", Vec_To_String(points[i]->intersection_point));
+        // Pixel_Print("Normal: ", Vec_To_String(points[i]->normal));
+        points[i]->color = vec3(0, 0, 0);
+
+        // Ensure the normal is normalized
+        vec3 normal = points[i]->normal.normalized();
+        if (normal.magnitude_squared() < 1e-6) continue;
+        valid[m] = i;
+        norm[m] = normal;
+        uv[m] = points[i]->hit.uv;
+        m++;
     }
 
-    // Retrieve material properties
-    vec3 ambient_color = color_ambient ? color_ambient->Get_Color(hit.uv) : vec3(0, 0, 0);
-    vec3 diffuse_color = color_diffuse ? color_diffuse->Get_Color(hit.uv) : vec3(0, 0, 0);
-    vec3 specular_color = color_specular ? color_specular->Get_Color(hit.uv) : vec3(0, 0, 0);
+    // When watching the scene file (-W), record where lights matter
+    if (Tile_Dependencies* dependencies = render_world.Recording())
+        for (int k = 0; k < m; k++)
+            dependencies->Add_Lit_Point(points[valid[k]]->intersection_point);
 
-    // Pixel_Print("texture (u,v): (", hit.uv[0], " ", hit.uv[1], ")");
-    // Small epsilon offset to avoid self-intersection
-    const double epsilon = 1e-4;
-    vec3 offset_point = intersection_point + norm * epsilon;
+    // Retrieve material properties
+    vec3 ambient_color[chunk], diffuse_color[chunk], specular_color[chunk];
+    if (color_ambient) color_ambient->Get_Colors(uv, m, ambient_color);
+    if (color_diffuse) color_diffuse->Get_Colors(uv, m, diffuse_color);
+    if (color_specular) color_specular->Get_Colors(uv, m, specular_color);
 
     // Ambient component
     if (render_world.ambient_color)
     {
-        vec3 ambient = render_world.ambient_intensity *
-                       render_world.ambient_color->Get_Color(vec2(0, 0)) * ambient_color;
-        color += ambient;
-        // Pixel_Print("Ambient color: ", Vec_To_String(ambient));
+        vec3 ambient_light = render_world.ambient_intensity *
+                             render_world.ambient_color->Get_Color(vec2(0, 0));
+        for (int k = 0; k < m; k++)
+        {
+            vec3 ambient = ambient_light * ambient_color[k];
+            points[valid[k]]->color += ambient;
+            // Pixel_Print("Ambient color: ", Vec_To_String(ambient));
+        }
     }
 
-    // Iterate over all lights in the scene
-    for (const auto* light : render_world.lights)
+    // The contribution of light i to point k
+    auto shade = [&](int i, int k)
     {
-        if (!light)
-            continue; // Skip null pointers
+        const Light* light = render_world.lights[i];
+        Shading_Point& p = *points[valid[k]];
 
         // Light direction and light intensity
-        vec3 l = (light->position - intersection_point); // Light vector
+        vec3 l = (light->position - p.intersection_point); // Light vector
         vec3 light_intensity = light->Emitted_Light(l);
 
         // Shadow handling
         bool in_shadow = false;
         if (render_world.enable_shadows)
         {
-            // Ray shadow_ray(offset_point, l);
-            Ray shadow_ray(intersection_point + norm * small_t, l);
-            auto [shadowed_object, shadow_hit] = render_world.Closest_Intersection(shadow_ray);
-
-            // Determine if the light is blocked
-            if (shadowed_object.object 
-                && shadow_hit.dist >= small_t       // Must be a valid intersection
-                && shadow_hit.dist < l.magnitude()) // Must be closer than the light
-            {
-                in_shadow = true;
-            }
+            Ray shadow_ray(p.intersection_point + norm[k] * small_t, l);
+
+            // The light is blocked if anything lies between it and the point
+            in_shadow = render_world.In_Shadow(shadow_ray, l.magnitude(), i);
         }
 
         // If not in shadow, calculate diffuse and specular contributions
@@ -86,30 +128,58 @@ vec3 Phong_Shader::Shade_Surface(const Render_World& render_world, const Ray& ra
         {
             // Diffuse component
             vec3 light_dir = l.normalized();
-            double diffuse_factor = std::max(dot(norm, light_dir), 0.0);
-            vec3 diffuse = diffuse_color * light_intensity * diffuse_factor;
-            color += diffuse;
+            double diffuse_factor = std::max(dot(norm[k], light_dir), 0.0);
+            vec3 diffuse = diffuse_color[k] * light_intensity * diffuse_factor;
+            p.color += diffuse;
             // Pixel_Print("Diffuse color: ", Vec_To_String(diffuse));
 
             // Specular component
-            vec3 view_dir = -ray.direction.normalized();
-            vec3 reflection_dir = (2.0 * dot(light_dir, norm) * norm - light_dir).normalized();
+            vec3 view_dir = -p.ray.direction.normalized();
+            vec3 reflection_dir = (2.0 * dot(light_dir, norm[k]) * norm[k] - light_dir).normalized();
             double specular_factor = std::pow(std::max(dot(view_dir, reflection_dir), 0.0), specular_power);
-            vec3 specular = specular_color * light_intensity * specular_factor;
-            color += specular;
+            vec3 specular = specular_color[k] * light_intensity * specular_factor;
+            p.color += specular;
+        }
+    };
+
+    // Iterate over all lights in the scene, or with light culling
+    // (--light-cutoff) only over those that reach each point.  Either way,
+    // each point adds up its lights in the order of the scene.
+    const Light_Grid& light_grid = render_world.light_grid;
+    if (light_grid.Empty())
+    {
+        for (size_t i = 0; i < render_world.lights.size(); i++)
+        {
+            if (!render_world.lights[i])
+                continue; // Skip null pointers
+            for (int k = 0; k < m; k++)
+                shade(i, k);
+        }
+    }
+    else
+    {
+        for (int k = 0; k < m; k++)
+        {
+            const vec3& point = points[valid[k]]->intersection_point;
+            auto candidates = light_grid.Candidates(point);
+            for (const int* i = candidates.first; i < candidates.second; i++)
+                if (light_grid.Reaches(*i, point))
+                    shade(*i, k);
         }
     }
 
     // Recursive reflection
     if (recursion_depth > render_world.recursion_depth_limit)
     {
-        vec3 reflection_dir = - ray.direction + 2 * dot(ray.direction, norm) * norm;
-        Ray reflection_ray(offset_point, reflection_dir.normalized());
-        vec3 reflected_color = render_world.Cast_Ray(reflection_ray, recursion_depth + 1);
+        for (int k = 0; k < m; k++)
+        {
+            Shading_Point& p = *points[valid[k]];
+            vec3 reflected_color = *p.colors++; // See Secondary_Rays
 
-        // Blend the reflected color with the local color (adjust blending ratio if needed)
-        double reflection_coefficient = 0.5; // Example value; this could depend on material properties
-        color = color * (1 - reflection_coefficient) + reflected_color * reflection_coefficient;
+            // Blend the reflected color with the local color (adjust blending ratio if needed)
+            double reflection_coefficient = 0.5; // Example value; this could depend on material properties
+            p.color = p.color * (1 - reflection_coefficient) + reflected_color * reflection_coefficient;
+        }
     }
     // else if (recursion_depth == render_world.recursion_depth_limit)
     // {
@@ -118,5 +188,4 @@ vec3 Phong_Shader::Shade_Surface(const Render_World& render_world, const Ray& ra
     //     color *= (1 - reflection_coefficient);
     // }
     // Pixel_Print("Final shaded color: ", Vec_To_String(color));
-    return color;
 }
@@ -14,10 +14,18 @@ public:
     Phong_Shader(const Parse* parse,std::istream& in);
     virtual ~Phong_Shader() = default;
 
-    virtual vec3 Shade_Surface(const Render_World& render_world,const Ray& ray,
+    virtual void Secondary_Rays(const Render_World& render_world,const Ray& ray,
         const Hit& hit,const vec3& intersection_point,const vec3& normal,
-        int recursion_depth) const override;
+        int recursion_depth,std::vector<Secondary_Ray>& rays) const override;
+    virtual void Combine(const Render_World& render_world,Shading_Point* const points[],
+        int n,int recursion_depth) const override;
 
     static constexpr const char* parse_name = "phong_shader";
+
+private:
+    // Combine at most chunk points
+    template<int chunk>
+    void Combine_Chunk(const Render_World& render_world,Shading_Point* const points[],
+        int n,int recursion_depth) const;
 };
 #endif
@@ -1,15 +1,23 @@
 #include "point_light.h"
 #include "parse.h"
 #include "color.h"
+#include <algorithm>
 
 Point_Light::Point_Light(const Parse* parse,std::istream& in)
 {
     in>>name>>position;
     color=parse->Get_Color(in);
     in>>brightness;
+    emitted=color->Get_Color({})*brightness;
 }
 
 vec3 Point_Light::Emitted_Light(const vec3& vector_to_light) const
 {
-    return color->Get_Color({})*brightness/(4*pi*vector_to_light.magnitude_squared());
+    return emitted/(4*pi*vector_to_light.magnitude_squared());
+}
+
+double Point_Light::Range(double cutoff) const
+{
+    double strongest=std::max(emitted[0],std::max(emitted[1],emitted[2]));
+    return std::sqrt(std::max(strongest,0.0)/(4*pi*cutoff));
 }
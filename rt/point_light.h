@@ -15,11 +15,13 @@ class Point_Light : public Light
 public:
     const Color* color = nullptr; // RGB color components
     double brightness = 0;
+    vec3 emitted; // color times brightness, looked up once
 
     Point_Light(const Parse* parse,std::istream& in);
     virtual ~Point_Light() = default;
 
     virtual vec3 Emitted_Light(const vec3& vector_to_light) const override;
+    virtual double Range(double cutoff) const override;
 
     static constexpr const char* parse_name = "point_light";
 };
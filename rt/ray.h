@@ -24,6 +24,28 @@ public:
     }
 };
 
+// Values derived from a ray that box tests need.  Since the members of Ray
+// may be changed freely, these are not kept in Ray itself.  Instead, a
+// traversal computes them once when it starts and uses them for every box it
+// tests.
+class Precomputed_Ray
+{
+public:
+    vec3 endpoint;
+    vec3 inverse_direction; // 1/direction; infinite for zero components
+    ivec3 sign; // 1 if the direction component is negative (including -0)
+
+    explicit Precomputed_Ray(const Ray& ray)
+        :endpoint(ray.endpoint)
+    {
+        for(int i=0;i<3;i++)
+        {
+            inverse_direction[i]=1/ray.direction[i];
+            sign[i]=inverse_direction[i]<0;
+        }
+    }
+};
+
 // Useful for debugging
 inline std::ostream& operator<<(std::ostream& o, const Ray& r)
 {
@@ -0,0 +1,69 @@
+#ifndef __RAY_PACKET_H__
+#define __RAY_PACKET_H__
+
+#include "ray.h"
+#include <limits>
+
+// A packet of rays that are traced together.  Each lane of a double4 holds
+// the value for one ray.  These use the compiler's vector extensions, so they
+// map onto SSE or AVX registers depending on the target the code is compiled
+// for (see SConstruct).
+static const int packet_size=4;
+typedef double double4 __attribute__((vector_size(packet_size*sizeof(double))));
+typedef long long long4 __attribute__((vector_size(packet_size*sizeof(long long))));
+typedef vec<double4,3> vec3x4;
+
+inline double4 Splat(double a)
+{
+    return double4{a,a,a,a};
+}
+
+inline vec3x4 Splat(const vec3& v)
+{
+    vec3x4 r;
+    for(int i=0;i<3;i++) r[i]=Splat(v[i]);
+    return r;
+}
+
+// Convert the result of a lane-wise comparison to a bit mask with bit k set
+// if the comparison is true for lane k.
+inline int Lane_Mask(const long4& m)
+{
+    int mask=0;
+    for(int k=0;k<packet_size;k++)
+        if(m[k]) mask|=1<<k;
+    return mask;
+}
+
+class Ray_Packet
+{
+public:
+    vec3x4 endpoint;
+    vec3x4 direction;
+    vec3x4 inverse_direction; // 1/direction, used for box tests
+
+    // Store ray in lane k.  The direction is copied as is (not normalized
+    // again) so that results match tracing the ray by itself.
+    void Set_Ray(int k,const Ray& ray)
+    {
+        for(int i=0;i<3;i++)
+        {
+            endpoint[i][k]=ray.endpoint[i];
+            direction[i][k]=ray.direction[i];
+            inverse_direction[i][k]=1/ray.direction[i];
+        }
+    }
+
+    Ray Get_Ray(int k) const
+    {
+        Ray ray;
+        for(int i=0;i<3;i++)
+        {
+            ray.endpoint[i]=endpoint[i][k];
+            ray.direction[i]=direction[i][k];
+        }
+        return ray;
+    }
+};
+
+#endif
@@ -11,31 +11,50 @@ Reflective_Shader::Reflective_Shader(const Parse* parse, std::istream& in)
     reflectivity = std::max(0.0, std::min(1.0, reflectivity));
 }
 
-vec3 Reflective_Shader::
-Shade_Surface(const Render_World& render_world, const Ray& ray, const Hit& hit,
-    const vec3& intersection_point, const vec3& normal, int recursion_depth) const
+// The mirror ray, which is cast when there is recursion depth left
+static Ray Reflected_Ray(const Ray& ray, const vec3& intersection_point, const vec3& normal)
 {
-    // Base color from the underlying shader
-    vec3 color = shader->Shade_Surface(render_world, ray, hit, intersection_point, normal, recursion_depth);
-
     // Define a small epsilon offset to avoid self-intersection
     const double epsilon = 1e-6;
 
     // Calculate reflection direction
     vec3 v_ray = ray.direction.normalized();
     vec3 r_dir = 2.0 * dot(-v_ray, normal) * normal + v_ray;
-    Ray reflected_ray(intersection_point + epsilon * normal, r_dir);
+    return Ray(intersection_point + epsilon * normal, r_dir);
+}
+
+void Reflective_Shader::
+Secondary_Rays(const Render_World& render_world, const Ray& ray, const Hit& hit,
+    const vec3& intersection_point, const vec3& normal, int recursion_depth,
+    std::vector<Secondary_Ray>& rays) const
+{
+    size_t first = rays.size();
+    shader->Secondary_Rays(render_world, ray, hit, intersection_point, normal, recursion_depth, rays);
+    for (size_t i = first; i < rays.size(); i++)
+        rays[i].weight *= 1 - reflectivity;
+    if (recursion_depth < render_world.recursion_depth_limit)
+        rays.push_back({Reflected_Ray(ray, intersection_point, normal), reflectivity});
+}
+
+void Reflective_Shader::
+Combine(const Render_World& render_world, Shading_Point* const points[], int n,
+    int recursion_depth) const
+{
+    // Base colors from the underlying shader
+    shader->Combine(render_world, points, n, recursion_depth);
 
     // Handle reflection contribution
     if (recursion_depth < render_world.recursion_depth_limit)
     {
-        vec3 reflected_color = render_world.Cast_Ray(reflected_ray, recursion_depth + 1);
-        color = (1 - reflectivity) * color + reflectivity * reflected_color;
+        for (int i = 0; i < n; i++)
+        {
+            vec3 reflected_color = *points[i]->colors++;
+            points[i]->color = (1 - reflectivity) * points[i]->color + reflectivity * reflected_color;
+        }
     }
     else // Recursion depth limit reached
     {
-        color = (1 - reflectivity) * color;
-    }    
-
-    return color;
+        for (int i = 0; i < n; i++)
+            points[i]->color = (1 - reflectivity) * points[i]->color;
+    }
 }
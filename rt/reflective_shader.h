@@ -13,9 +13,11 @@ public:
     Reflective_Shader(const Parse* parse,std::istream& in);
     virtual ~Reflective_Shader() = default;
     
-    virtual vec3 Shade_Surface(const Render_World& render_world,const Ray& ray,
+    virtual void Secondary_Rays(const Render_World& render_world,const Ray& ray,
         const Hit& hit,const vec3& intersection_point,const vec3& normal,
-        int recursion_depth) const override;
+        int recursion_depth,std::vector<Secondary_Ray>& rays) const override;
+    virtual void Combine(const Render_World& render_world,Shading_Point* const points[],
+        int n,int recursion_depth) const override;
 
     static constexpr const char* parse_name = "reflective_shader";
 };
@@ -3,8 +3,46 @@
 #include "object.h"
 #include "light.h"
 #include "ray.h"
+#include "parallel.h"
+#include "shader.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <map>
 
 extern bool enable_acceleration;
+extern bool enable_packets;
+extern bool print_statistics;
+extern double time_budget;
+extern int antialias_samples;
+extern bool wavefront_rendering;
+extern double minimum_throughput;
+extern bool russian_roulette;
+extern double light_cutoff;
+extern bool relighting;
+extern bool single_precision;
+extern bool watch_scene;
+
+// The image is rendered in square tiles of this many pixels on a side, which
+// are spread across threads.  This must be even, so that packets (-p) never
+// straddle tiles.
+static const int tile_size=16;
+
+// Pixels are supersampled when a color channel differs by more than this
+// from a neighbor.
+static const double contrast_threshold=0.1;
+
+static std::atomic<unsigned long long> next_serial{1};
+
+// The dependencies of the tile that this thread is rendering, when watching
+// the scene file (-W)
+static thread_local Tile_Dependencies* recording = nullptr;
+
+Render_World::Render_World()
+    : serial(next_serial++)
+{
+}
 
 Render_World::~Render_World()
 {
@@ -20,6 +58,13 @@ std::pair<Shaded_Object, Hit> Render_World::Closest_Intersection(const Ray& ray)
     // Pixel_Print("Finding closest intersection for ray.");
     // Debug_Ray("Ray", ray);
 
+    if (enable_acceleration)
+    {
+        auto [id, hit] = acceleration.Closest_Intersection(ray);
+        if (id >= 0) return {objects[id], hit};
+        return {{}, hit};
+    }
+
     Hit closest_hit;
     // Initialize distance to infinity so that any valid intersection replaces it
     closest_hit.dist = std::numeric_limits<double>::infinity(); 
@@ -85,35 +130,670 @@ std::pair<Shaded_Object, Hit> Render_World::Closest_Intersection(const Ray& ray)
     return {closest_object, closest_hit};
 }
 
+void Render_World::Closest_Intersection(const Ray_Packet& packet, int mask,
+    Shaded_Object closest_objects[], Hit closest_hits[]) const
+{
+    int ids[packet_size];
+    acceleration.Closest_Intersection(packet, mask, ids, closest_hits);
+    for (int k = 0; k < packet_size; k++)
+        if (mask & (1 << k))
+            closest_objects[k] = ids[k] >= 0 ? objects[ids[k]] : Shaded_Object();
+}
+
+// Return whether any object blocks the ray before t_max.  Used for shadow rays.
+bool Render_World::Any_Intersection(const Ray& ray, double t_max, Occluder* occluder) const
+{
+    if (enable_acceleration)
+        return acceleration.Any_Intersection(ray, t_max, occluder);
+
+    for (const auto& obj : objects)
+    {
+        int part = -1;
+        if (obj.object->Any_Intersection(ray, -1, t_max, &part))
+        {
+            if (occluder) *occluder = {obj.object, part};
+            return true;
+        }
+    }
+    return false;
+}
+
+// The last occluder found toward each light, kept by each thread for the
+// world with the given serial number.
+struct Occluder_Cache
+{
+    unsigned long long serial = 0;
+    std::vector<Occluder> occluders;
+};
+static thread_local Occluder_Cache occluder_cache;
+
+// A cached occluder that blocks the ray is as good an answer as any other, so
+// the result is the same as Any_Intersection's.  On a miss, the occluder is
+// replaced by the one that the full query finds, if any.
+bool Render_World::In_Shadow(const Ray& ray, double t_max, int light) const
+{
+    Occluder_Cache& cache = occluder_cache;
+    if (cache.serial != serial)
+    {
+        cache.serial = serial;
+        cache.occluders.assign(lights.size(), Occluder());
+    }
+    Occluder& last = cache.occluders[light];
+    bool hit = last.object && last.object->Any_Intersection(ray, last.part, t_max);
+    bool blocked = hit || Any_Intersection(ray, t_max, &last);
+    if (print_statistics)
+    {
+        shadow_rays.fetch_add(1, std::memory_order_relaxed);
+        if (blocked) blocked_shadow_rays.fetch_add(1, std::memory_order_relaxed);
+        if (hit) occluder_cache_hits.fetch_add(1, std::memory_order_relaxed);
+    }
+    return blocked;
+}
+
+void Render_World::Print_Statistics(std::ostream& out) const
+{
+    out << "occluder cache: " << shadow_rays << " shadow rays, "
+        << blocked_shadow_rays << " blocked, " << occluder_cache_hits
+        << " by the cached occluder";
+    if (blocked_shadow_rays)
+        out << " (hit rate: " << 100.0 * occluder_cache_hits / blocked_shadow_rays << "%)";
+    out << std::endl;
+    if (!light_grid.Empty())
+        light_grid.Print_Statistics(out);
+}
 
 // Set up the initial view ray and call Cast_Ray
 void Render_World::Render_Pixel(const ivec2& pixel_index)
 {
     // Pixel_Print("Rendering pixel: (", pixel_index[0], " ", pixel_index[1], ")");
 
+    Ray ray = Primary_Ray(pixel_index);
+    Primary_Id id;
+    G_Buffer_Entry* entry = nullptr;
+    if (!g_buffer.empty())
+        entry = &g_buffer[pixel_index[1] * camera.number_pixels[0] + pixel_index[0]];
+    vec3 color = Trace_Primary(ray, id, entry); // Cast ray with recursion depth = 1
+    camera.Set_Pixel(pixel_index, Pixel_Color(color)); // Set the pixel color
+    if (!primary_ids.empty())
+        primary_ids[pixel_index[1] * camera.number_pixels[0] + pixel_index[0]] = id;
+    // Pixel_Print("Pixel color: ", Vec_To_String(color));
+}
+
+Ray Render_World::Primary_Ray(const ivec2& pixel_index)
+{
     Ray ray;
     ray.endpoint = camera.position; // Camera position as the ray origin
     ray.direction = (camera.World_Position(pixel_index) - camera.position).normalized(); // Direction toward the pixel
+    return ray;
+}
 
-    vec3 color = Cast_Ray(ray, 1); // Cast ray with recursion depth = 1
-    camera.Set_Pixel(pixel_index, Pixel_Color(color)); // Set the pixel color
-    // Pixel_Print("Pixel color: ", Vec_To_String(color));
+Ray Render_World::Primary_Ray(const vec2& film_point) const
+{
+    Ray ray;
+    ray.endpoint = camera.position;
+    ray.direction = (camera.World_Position(film_point) - camera.position).normalized();
+    return ray;
+}
+
+// Render the 2x2 block of pixels starting at corner, tracing the primary rays
+// together as a packet.  Secondary rays are traced one at a time through
+// Cast_Ray, since they quickly lose coherence.  If the primary rays do not all
+// point into the same octant, they are not coherent enough to benefit, so the
+// pixels are rendered one at a time instead.
+void Render_World::Render_Packet(const ivec2& corner)
+{
+    Ray rays[packet_size];
+    ivec2 pixels[packet_size];
+    Ray_Packet packet;
+    int mask = 0;
+    for (int k = 0; k < packet_size; k++)
+    {
+        pixels[k] = corner + ivec2(k & 1, k >> 1);
+        if (pixels[k][0] < camera.number_pixels[0] && pixels[k][1] < camera.number_pixels[1])
+            mask |= 1 << k;
+        else
+            pixels[k] = corner;
+        rays[k] = Primary_Ray(pixels[k]);
+        packet.Set_Ray(k, rays[k]);
+    }
+
+    bool coherent = recursion_depth_limit >= 1;
+    for (int k = 1; k < packet_size; k++)
+        for (int i = 0; i < 3; i++)
+            if ((rays[k].direction[i] < 0) != (rays[0].direction[i] < 0))
+                coherent = false;
+    if (!coherent)
+    {
+        for (int k = 0; k < packet_size; k++)
+            if (mask & (1 << k))
+                Render_Pixel(pixels[k]);
+        return;
+    }
+
+    Shaded_Object closest_objects[packet_size];
+    Hit closest_hits[packet_size];
+    Closest_Intersection(packet, mask, closest_objects, closest_hits);
+    for (int k = 0; k < packet_size; k++)
+    {
+        if (!(mask & (1 << k))) continue;
+        vec3 color = Shade_Hit(rays[k], closest_objects[k], closest_hits[k], 1);
+        camera.Set_Pixel(pixels[k], Pixel_Color(color));
+        if (!primary_ids.empty())
+            primary_ids[pixels[k][1] * camera.number_pixels[0] + pixels[k][0]] =
+                {closest_objects[k].object, closest_objects[k].shader, closest_hits[k].triangle};
+    }
+}
+
+ivec2 Render_World::Number_Tiles() const
+{
+    return (camera.number_pixels + (tile_size - 1)) / tile_size;
+}
+
+void Render_World::Tile_Bounds(int tile, ivec2& begin, ivec2& end) const
+{
+    int columns = Number_Tiles()[0];
+    begin = ivec2(tile % columns, tile / columns) * tile_size;
+    end = componentwise_min(begin + tile_size, camera.number_pixels);
+}
+
+// Render the pixels of a tile, as 2x2 packets if packets is true.
+static void Render_Tile(Render_World& render_world, int tile, bool packets)
+{
+    ivec2 begin, end;
+    render_world.Tile_Bounds(tile, begin, end);
+    int step = packets ? 2 : 1;
+    for (int j = begin[1]; j < end[1]; j += step)
+    {
+        for (int i = begin[0]; i < end[0]; i += step)
+        {
+            if (packets) render_world.Render_Packet(ivec2(i, j));
+            else render_world.Render_Pixel(ivec2(i, j)); // Render each pixel
+        }
+    }
+}
+
+// The objects of the previous frame are matched to those of this frame by
+// their position in the scene and their names.
+void Render_World::Prepare(Render_World* previous)
+{
+    if (prepared) return;
+    prepared = true;
+    for (size_t i = 0; i < all_objects.size(); i++)
+    {
+        Object* previous_object = nullptr;
+        if (previous && i < previous->all_objects.size() &&
+            previous->all_objects[i]->name == all_objects[i]->name)
+            previous_object = previous->all_objects[i];
+        all_objects[i]->Prepare(previous_object);
+    }
+    if (enable_acceleration)
+    {
+        for (size_t i = 0; i < objects.size(); i++)
+            acceleration.Add_Object(objects[i].object, i);
+        if (previous) acceleration.Initialize(previous->acceleration);
+        else acceleration.Initialize();
+    }
+    if (light_cutoff > 0)
+        light_grid.Initialize(lights, light_cutoff);
+}
+
+void Render_World::Render(Render_World* previous)
+{
+    auto start = std::chrono::steady_clock::now();
+    Prepare(previous);
+
+    // When watching the scene file, every tile records what it depends on,
+    // so that later edits only render the tiles they change.
+    ivec2 tiles = Number_Tiles();
+    if (watch_scene)
+    {
+        std::vector<int> all(tiles[0] * tiles[1]);
+        for (size_t t = 0; t < all.size(); t++) all[t] = t;
+        tile_dependencies.assign(all.size(), Tile_Dependencies());
+        Render_Tiles(all);
+        return;
+    }
+
+    if (antialias_samples > 1)
+        primary_ids.assign(camera.number_pixels[0] * camera.number_pixels[1], Primary_Id());
+
+    if (time_budget > 0)
+    {
+        Render_Progressive(start);
+        return;
+    }
+
+    // When relighting, the first hits are loaded if this geometry and camera
+    // have been rendered before, and otherwise recorded by Render_Pixel, so
+    // neither packets nor the wavefront renderer are used.
+    bool record_g_buffer = false;
+    if (relighting && recursion_depth_limit >= 1)
+    {
+        if (Load_G_Buffer())
+        {
+            Relight();
+            if (antialias_samples > 1)
+                Anti_Alias(std::chrono::steady_clock::time_point::max());
+            return;
+        }
+        g_buffer.assign(camera.number_pixels[0] * camera.number_pixels[1], G_Buffer_Entry());
+        record_g_buffer = true;
+    }
+
+    // The wavefront renderer handles a whole row of tiles at a time, so that
+    // its stages are large enough to sort into coherent batches.
+    if (wavefront_rendering && !record_g_buffer)
+    {
+        int rows = (camera.number_pixels[1] + tile_size - 1) / tile_size;
+        Work_Stealing_For(rows, Number_Threads(), [this](int row)
+        {
+            ivec2 begin(0, row * tile_size);
+            ivec2 end = componentwise_min(begin + ivec2(camera.number_pixels[0], tile_size),
+                camera.number_pixels);
+            Render_Wavefront(begin, end);
+        });
+        if (antialias_samples > 1)
+            Anti_Alias(std::chrono::steady_clock::time_point::max());
+        return;
+    }
+
+    // Each pixel is computed independently of all others, so the image does
+    // not depend on the number of threads or the order of the tiles.
+    bool packets = enable_packets && enable_acceleration && !record_g_buffer;
+    Work_Stealing_For(tiles[0] * tiles[1], Number_Threads(), [this, packets](int tile)
+    {
+        Render_Tile(*this, tile, packets);
+    });
+    if (record_g_buffer)
+        Save_G_Buffer();
+
+    if (antialias_samples > 1)
+        Anti_Alias(std::chrono::steady_clock::time_point::max());
+}
+
+void Tile_Dependencies::Add_Shader(const Shader* shader)
+{
+    if (std::find(shaders.begin(), shaders.end(), shader) == shaders.end())
+        shaders.push_back(shader);
+}
+
+Tile_Dependencies* Render_World::Recording() const
+{
+    return recording;
+}
+
+void Render_World::Render_Tiles(const std::vector<int>& tiles)
+{
+    bool packets = enable_packets && enable_acceleration;
+    bool record = !tile_dependencies.empty();
+    Work_Stealing_For(tiles.size(), Number_Threads(), [this, packets, record, &tiles](int t)
+    {
+        if (record)
+        {
+            Tile_Dependencies& dependencies = tile_dependencies[tiles[t]];
+            dependencies = Tile_Dependencies();
+            dependencies.lit_points.Make_Empty();
+            recording = &dependencies;
+        }
+        Render_Tile(*this, tiles[t], packets);
+        recording = nullptr;
+    });
+}
+
+// A tile may change if one of its shaders changed, which includes changes to
+// the shaders and colors that they use (see Parse::definition), or if a light
+// that changed may reach one of its lit points.  Without light culling,
+// every light reaches every point.  With it, a light reaches the sphere of
+// its range (see Light_Grid), and both the old and the new sphere of a
+// changed light must be tested.
+bool Render_World::Changed_Tiles(const Render_World& edited, std::vector<int>& tiles) const
+{
+    if (tile_dependencies.empty() || edited.geometry_key.value != geometry_key.value ||
+        edited.settings_key.value != settings_key.value || edited.objects.size() != objects.size())
+        return false;
+
+    std::vector<const Shader*> changed_shaders;
+    for (const Shader* s : all_shaders)
+    {
+        auto it = edited.shader_keys.find(s->name);
+        if (it == edited.shader_keys.end() || it->second != shader_keys.at(s->name))
+            changed_shaders.push_back(s);
+    }
+
+    // The spheres of the changed lights, as a grid and a light of that grid
+    std::vector<std::pair<const Light_Grid*, int>> changed_lights;
+    bool all_lights = false;
+    size_t number_lights = std::max(lights.size(), edited.lights.size());
+    for (size_t i = 0; i < number_lights; i++)
+    {
+        if (i < lights.size() && i < edited.lights.size() && light_keys[i] == edited.light_keys[i])
+            continue;
+        if (light_grid.Empty())
+        {
+            all_lights = true;
+            break;
+        }
+        if (i < lights.size()) changed_lights.push_back({&light_grid, i});
+        if (i < edited.lights.size()) changed_lights.push_back({&edited.light_grid, i});
+    }
+
+    tiles.clear();
+    for (size_t t = 0; t < tile_dependencies.size(); t++)
+    {
+        const Tile_Dependencies& d = tile_dependencies[t];
+        bool changed = false;
+        for (const Shader* s : d.shaders)
+            if (std::find(changed_shaders.begin(), changed_shaders.end(), s) != changed_shaders.end())
+                changed = true;
+        if (d.lit)
+        {
+            if (all_lights) changed = true;
+            for (const auto& l : changed_lights)
+                if (l.first->Reaches(l.second, d.lit_points))
+                    changed = true;
+        }
+        if (changed) tiles.push_back(t);
+    }
+    return true;
+}
+
+int Render_World::Update(Render_World& edited)
+{
+    if (light_cutoff > 0)
+        edited.light_grid.Initialize(edited.lights, light_cutoff);
+    std::vector<int> tiles;
+    if (!Changed_Tiles(edited, tiles)) return -1;
+
+    // The recorded shaders of the other tiles did not change, so they have a
+    // counterpart of the same name in edited.
+    std::map<std::string, const Shader*> edited_shaders;
+    for (const Shader* s : edited.all_shaders)
+        edited_shaders[s->name] = s;
+    for (auto& d : tile_dependencies)
+        for (auto& s : d.shaders)
+        {
+            auto it = edited_shaders.find(s->name);
+            s = it != edited_shaders.end() ? it->second : nullptr;
+        }
+
+    // Swapping leaves the old shaders, colors and lights to be freed with
+    // edited.  The objects are the same, but shaded by the new shaders.
+    std::swap(all_shaders, edited.all_shaders);
+    std::swap(all_colors, edited.all_colors);
+    std::swap(lights, edited.lights);
+    std::swap(light_grid, edited.light_grid);
+    for (size_t i = 0; i < objects.size(); i++)
+        objects[i].shader = edited.objects[i].shader;
+    background_shader = edited.background_shader;
+    ambient_color = edited.ambient_color;
+    ambient_intensity = edited.ambient_intensity;
+    shader_keys = edited.shader_keys;
+    light_keys = edited.light_keys;
+
+    // The lights may have changed, so the occluder caches start over.
+    serial = next_serial++;
+    Render_Tiles(tiles);
+    return tiles.size();
 }
 
-void Render_World::Render()
+// Shading from a G-buffer entry does what Trace_Primary does after finding
+// the closest hit, so the image is identical to a full render.
+void Render_World::Relight()
 {
-    for (int j = 0; j < camera.number_pixels[1]; j++)
+    int width = camera.number_pixels[0];
+    ivec2 tiles = (camera.number_pixels + (tile_size - 1)) / tile_size;
+    Work_Stealing_For(tiles[0] * tiles[1], Number_Threads(), [this, width, &tiles](int tile)
     {
-        for (int i = 0; i < camera.number_pixels[0]; i++)
+        ivec2 begin = ivec2(tile % tiles[0], tile / tiles[0]) * tile_size;
+        ivec2 end = componentwise_min(begin + tile_size, camera.number_pixels);
+        for (int j = begin[1]; j < end[1]; j++)
         {
-            Render_Pixel(ivec2(i, j)); // Render each pixel
+            for (int i = begin[0]; i < end[0]; i++)
+            {
+                const G_Buffer_Entry& e = g_buffer[j * width + i];
+                Ray ray = Primary_Ray(ivec2(i, j));
+                vec3 color;
+                if (e.object.object)
+                    color = e.object.shader->Shade_Surface(*this, ray, e.hit,
+                        e.intersection_point, e.normal, 1);
+                else if (background_shader)
+                    color = background_shader->Shade_Surface(*this, ray, {}, {}, {}, 1);
+                camera.Set_Pixel(ivec2(i, j), Pixel_Color(color));
+                if (!primary_ids.empty())
+                    primary_ids[j * width + i] = {e.object.object, e.object.shader, e.hit.triangle};
+            }
         }
+    });
+    if (print_statistics)
+        std::cout << "relighting: reused the first hits of " << g_buffer.size()
+                  << " pixels" << std::endl;
+}
+
+// A G-buffer entry as it is saved, with the shaded object as an index into
+// objects, so that shaders can be changed between runs.
+struct Saved_G_Buffer_Entry
+{
+    int object; // -1 for the background
+    Hit hit;
+    vec3 intersection_point;
+    vec3 normal;
+};
+
+// Primary rays hit the same points as long as the parsed geometry, including
+// the vertices, triangles and texture coordinates of the meshes, and the
+// camera are the same.  Single precision (-F) rounds the vertices.
+uint64_t Render_World::G_Buffer_Key() const
+{
+    Cache_Key key = geometry_key;
+    key.Add(single_precision);
+    return key.value;
+}
+
+void Render_World::Save_G_Buffer() const
+{
+    std::map<std::pair<const Object*, const Shader*>, int> index;
+    for (int i = objects.size() - 1; i >= 0; i--)
+        index[{objects[i].object, objects[i].shader}] = i;
+
+    std::vector<Saved_G_Buffer_Entry> saved(g_buffer.size());
+    for (size_t i = 0; i < g_buffer.size(); i++)
+    {
+        const G_Buffer_Entry& e = g_buffer[i];
+        saved[i] = {-1, e.hit, e.intersection_point, e.normal};
+        if (e.object.object) saved[i].object = index[{e.object.object, e.object.shader}];
     }
+    Cache_Writer out("gbuffer", G_Buffer_Key());
+    out.Write(saved);
+}
+
+bool Render_World::Load_G_Buffer()
+{
+    std::vector<Saved_G_Buffer_Entry> saved;
+    Cache_Reader in("gbuffer", G_Buffer_Key());
+    if (!in.Read(saved) || saved.size() != (size_t)camera.number_pixels[0] * camera.number_pixels[1])
+        return false;
+    g_buffer.resize(saved.size());
+    for (size_t i = 0; i < saved.size(); i++)
+    {
+        const Saved_G_Buffer_Entry& s = saved[i];
+        if (s.object >= (int)objects.size()) return false;
+        g_buffer[i] = {s.object >= 0 ? objects[s.object] : Shaded_Object(), s.hit,
+            s.intersection_point, s.normal};
+    }
+    return true;
+}
+
+// The first pass traces one pixel in each tile_size x tile_size block and
+// fills the whole block with its color.  Each later pass halves the block
+// size, tracing the corners of the new blocks that were not traced before,
+// until the last pass traces every remaining pixel.  A finished render is
+// identical to one without a time budget.  Tiles are skipped once the budget
+// has run out, except during the first pass, so that the image is always
+// complete, if coarse.
+void Render_World::Render_Progressive(std::chrono::steady_clock::time_point start)
+{
+    auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double, std::milli>(time_budget));
+    ivec2 tiles = (camera.number_pixels + (tile_size - 1)) / tile_size;
+    int passes = 0, total_passes = 0;
+    std::atomic<bool> expired(false);
+    for (int size = tile_size; size >= 1; size /= 2, total_passes++)
+    {
+        if (expired || (passes > 0 && std::chrono::steady_clock::now() >= deadline)) continue;
+        Work_Stealing_For(tiles[0] * tiles[1], Number_Threads(),
+            [this, size, passes, deadline, &tiles, &expired](int tile)
+            {
+                if (passes > 0 && std::chrono::steady_clock::now() >= deadline)
+                {
+                    expired = true;
+                    return;
+                }
+                ivec2 begin = ivec2(tile % tiles[0], tile / tiles[0]) * tile_size;
+                ivec2 end = componentwise_min(begin + tile_size, camera.number_pixels);
+                for (int j = begin[1]; j < end[1]; j += size)
+                {
+                    for (int i = begin[0]; i < end[0]; i += size)
+                    {
+                        // Traced by an earlier pass
+                        if (passes > 0 && i % (2 * size) == 0 && j % (2 * size) == 0) continue;
+                        Render_Pixel(ivec2(i, j));
+                        Pixel color = camera.Get_Pixel(ivec2(i, j));
+                        ivec2 block_end = componentwise_min(ivec2(i, j) + size, end);
+                        for (int y = j; y < block_end[1]; y++)
+                            for (int x = i; x < block_end[0]; x++)
+                                camera.Set_Pixel(ivec2(x, y), color);
+                    }
+                }
+            });
+        if (!expired) passes++;
+    }
+    if (antialias_samples > 1 && passes == total_passes)
+        Anti_Alias(deadline);
+
+    if (print_statistics)
+    {
+        double elapsed = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+        std::cout << "progressive: " << passes << " of " << total_passes
+                  << " passes completed in " << elapsed << " ms (budget: "
+                  << time_budget << " ms)" << std::endl;
+    }
+}
+
+// The splitmix64 finalizer, which scrambles the bits of x.
+static uint64_t Mix_Bits(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// A pseudorandom number in [0,1) for sample k of a pixel.  It only depends on
+// its arguments, so the image does not depend on the order of rendering.
+static double Jitter(const ivec2& pixel, int k)
+{
+    uint64_t x = ((uint64_t)(unsigned)pixel[1] << 40) ^ ((uint64_t)(unsigned)pixel[0] << 16) ^ k;
+    return (Mix_Bits(x) >> 11) * 0x1p-53;
+}
+
+// The pixels on edges are those whose color differs by more than
+// contrast_threshold from one of their four neighbors, or whose primary ray
+// hit a different object or triangle.  For these, the sample through the
+// pixel center is averaged with an m x n grid of jittered samples, with n as
+// large as antialias_samples allows and m >= n as wide, so that limits
+// between squares are used too.  Everywhere else, the single sample is
+// kept, so smooth regions cost nothing more.  Edges are found from a copy of
+// the image, so they do not depend on which pixels have been supersampled.
+void Render_World::Anti_Alias(std::chrono::steady_clock::time_point deadline)
+{
+    int samples = antialias_samples - 1;
+    if (samples < 1) return;
+    int n = 1;
+    while ((n + 1) * (n + 1) <= samples) n++;
+    int m = samples / n;
+
+    int width = camera.number_pixels[0];
+    std::vector<Pixel> colors(camera.colors, camera.colors + width * camera.number_pixels[1]);
+    auto differs = [this, &colors, width](const ivec2& a, const ivec2& b)
+    {
+        if (b[0] < 0 || b[1] < 0 || b[0] >= width || b[1] >= camera.number_pixels[1])
+            return false;
+        int i = a[1] * width + a[0], j = b[1] * width + b[0];
+        if (!(primary_ids[i] == primary_ids[j])) return true;
+        vec3 d = From_Pixel(colors[i]) - From_Pixel(colors[j]);
+        for (int c = 0; c < 3; c++)
+            if (std::abs(d[c]) > contrast_threshold) return true;
+        return false;
+    };
+
+    std::atomic<long long> supersampled(0);
+    ivec2 tiles = (camera.number_pixels + (tile_size - 1)) / tile_size;
+    Work_Stealing_For(tiles[0] * tiles[1], Number_Threads(),
+        [this, n, m, deadline, &tiles, &differs, &supersampled](int tile)
+        {
+            if (std::chrono::steady_clock::now() >= deadline) return;
+            ivec2 begin = ivec2(tile % tiles[0], tile / tiles[0]) * tile_size;
+            ivec2 end = componentwise_min(begin + tile_size, camera.number_pixels);
+            int count = 0;
+            for (int j = begin[1]; j < end[1]; j++)
+            {
+                for (int i = begin[0]; i < end[0]; i++)
+                {
+                    ivec2 pixel(i, j);
+                    if (!differs(pixel, ivec2(i - 1, j)) && !differs(pixel, ivec2(i + 1, j)) &&
+                        !differs(pixel, ivec2(i, j - 1)) && !differs(pixel, ivec2(i, j + 1)))
+                        continue;
+
+                    vec3 one(1, 1, 1);
+                    vec3 sum = componentwise_min(From_Pixel(camera.Get_Pixel(pixel)), one);
+                    for (int b = 0; b < n; b++)
+                    {
+                        for (int a = 0; a < m; a++)
+                        {
+                            int k = b * m + a;
+                            vec2 offset((a + Jitter(pixel, 2 * k)) / m, (b + Jitter(pixel, 2 * k + 1)) / n);
+                            vec2 film_point = camera.min + (vec2(pixel) + offset) * camera.pixel_size;
+                            Primary_Id id;
+                            sum += componentwise_min(Trace_Primary(Primary_Ray(film_point), id), one);
+                        }
+                    }
+                    camera.Set_Pixel(pixel, Pixel_Color(sum / (m * n + 1)));
+                    count++;
+                }
+            }
+            supersampled += count;
+        });
+
+    if (print_statistics)
+    {
+        long long pixels = (long long)width * camera.number_pixels[1];
+        std::cout << "anti-aliasing: " << supersampled << " of " << pixels
+                  << " pixels supersampled; samples/pixel: "
+                  << (double)(pixels + supersampled * m * n) / pixels << std::endl;
+    }
+}
+
+vec3 Render_World::Trace_Primary(const Ray& ray, Primary_Id& id, G_Buffer_Entry* entry) const
+{
+    if (recursion_depth_limit < 1) return vec3(0, 0, 0);
+    auto [closest_object, closest_hit] = Closest_Intersection(ray);
+    id = {closest_object.object, closest_object.shader, closest_hit.triangle};
+    if (entry)
+    {
+        // The same point and normal that Shade_Hit computes
+        *entry = {closest_object, closest_hit, vec3(), vec3()};
+        if (closest_object.object)
+        {
+            entry->intersection_point = ray.Point(closest_hit.dist);
+            entry->normal = closest_object.object->Normal(ray, closest_hit);
+        }
+    }
+    return Shade_Hit(ray, closest_object, closest_hit, 1);
 }
 
 // Cast ray and return the color of the closest intersected surface point,
 // or the background color if there is no object intersection
-vec3 Render_World::Cast_Ray(const Ray& ray, int recursion_depth) const
+vec3 Render_World::Cast_Ray(const Ray& ray, int recursion_depth, double throughput) const
 {
     // Pixel_Print("Casting ray at recursion depth: ", recursion_depth);
     // Debug_Ray("Ray", ray);
@@ -125,7 +805,18 @@ vec3 Render_World::Cast_Ray(const Ray& ray, int recursion_depth) const
     }
 
     auto [closest_object, closest_hit] = Closest_Intersection(ray);
+    return Shade_Hit(ray, closest_object, closest_hit, recursion_depth, throughput);
+}
 
+// Return the color seen along ray, given its closest intersection.
+vec3 Render_World::Shade_Hit(const Ray& ray, const Shaded_Object& closest_object,
+    const Hit& closest_hit, int recursion_depth, double throughput) const
+{
+    if (recording)
+    {
+        const Shader* shader = closest_object.object ? closest_object.shader : background_shader;
+        if (shader) recording->Add_Shader(shader);
+    }
     if (closest_object.object)
     {
         // Calculate the intersection point and normal
@@ -136,7 +827,7 @@ vec3 Render_World::Cast_Ray(const Ray& ray, int recursion_depth) const
         // Pixel_Print("Normal at intersection: ", Vec_To_String(normal));
 
         // Shade the surface using the object's shader
-        vec3 shaded_color = closest_object.shader->Shade_Surface(*this, ray, closest_hit, intersection_point, normal, recursion_depth);
+        vec3 shaded_color = closest_object.shader->Shade_Surface(*this, ray, closest_hit, intersection_point, normal, recursion_depth, throughput);
         // Pixel_Print("Final shaded color: ", Vec_To_String(shaded_color));
 
         return shaded_color;
@@ -144,9 +835,38 @@ vec3 Render_World::Cast_Ray(const Ray& ray, int recursion_depth) const
     else if (background_shader)
     {
         // Pixel_Print("No intersection. Using background shader.");
-        return background_shader->Shade_Surface(*this, ray, {}, {}, {}, recursion_depth);
+        return background_shader->Shade_Surface(*this, ray, {}, {}, {}, recursion_depth, throughput);
     }
 
     // Pixel_Print("No intersection and no background shader. Returning black.");
     return vec3(0, 0, 0); // Return black if no object and no background shader
 }
+
+// Secondary rays whose throughput is below minimum_throughput contribute too
+// little to be worth tracing.  They are dropped, or with Russian roulette,
+// traced with probability throughput/minimum_throughput and their color
+// scaled up to make up for the rays that were dropped, which keeps the image
+// unbiased on average.  The roulette is decided by a hash of the ray, so the
+// image does not depend on the order of rendering.  The throughput can be
+// negative, since shaders may weight colors by factors outside [0,1] (such as
+// an opacity above 1), so only its magnitude is compared.
+double Render_World::Continuation_Scale(const Ray& ray, double throughput) const
+{
+    if (minimum_throughput <= 0) return 1;
+    throughput = std::abs(throughput);
+    if (throughput >= minimum_throughput) return 1;
+    if (!russian_roulette || throughput == 0) return 0;
+
+    uint64_t x = 0;
+    for (int a = 0; a < 3; a++)
+    {
+        uint64_t bits[2];
+        memcpy(&bits[0], &ray.endpoint[a], sizeof(double));
+        memcpy(&bits[1], &ray.direction[a], sizeof(double));
+        x = Mix_Bits(x ^ bits[0]);
+        x = Mix_Bits(x ^ bits[1]);
+    }
+    double probability = throughput / minimum_throughput;
+    if ((x >> 11) * 0x1p-53 >= probability) return 0;
+    return 1 / probability;
+}
@@ -1,15 +1,23 @@
 #ifndef __RENDER_WORLD_H__
 #define __RENDER_WORLD_H__
 
+#include <atomic>
+#include <chrono>
+#include <iosfwd>
+#include <map>
+#include <string>
 #include <vector>
 #include <utility>
 #include "camera.h"
 #include "object.h"
-// #include "acceleration.h"
+#include "acceleration.h"
+#include "light_grid.h"
+#include "cache.h"
 
 class Light;
 class Shader;
 class Ray;
+class Ray_Packet;
 class Color;
 
 struct Shaded_Object
@@ -18,6 +26,50 @@ struct Shaded_Object
     const Shader* shader = nullptr;
 };
 
+// What the primary ray of a pixel hit.  Pixels whose neighbors hit something
+// else lie on an edge and are supersampled (-A).
+struct Primary_Id
+{
+    const Object* object = nullptr;
+    const Shader* shader = nullptr;
+    int triangle = -1;
+
+    bool operator==(const Primary_Id& id) const
+    {
+        return object == id.object && shader == id.shader && triangle == id.triangle;
+    }
+};
+
+// What the primary ray of a pixel hit, and where, kept for relighting (-g).
+struct G_Buffer_Entry
+{
+    Shaded_Object object; // no object for the background
+    Hit hit;
+    vec3 intersection_point;
+    vec3 normal;
+};
+
+// What the pixels of a tile depended on when they were last rendered, so that
+// watching the scene file (-W) only renders again the tiles that an edit can
+// change.
+struct Tile_Dependencies
+{
+    // Shaders of the surfaces hit by any ray of the tile, and the background
+    // shader if a ray missed everything
+    std::vector<const Shader*> shaders;
+    // Bounds the points that were lit by Phong shading; lit is false if there
+    // were none.
+    Box lit_points;
+    bool lit = false;
+
+    void Add_Shader(const Shader* shader);
+    void Add_Lit_Point(const vec3& point)
+    {
+        lit_points.Include_Point(point);
+        lit = true;
+    }
+};
+
 class Render_World
 {
 public:
@@ -44,15 +96,135 @@ public:
     bool enable_shadows = true;
     int recursion_depth_limit = 3;
 
-//     Acceleration acceleration;
+    Acceleration acceleration;
+
+    // Lights that reach each part of the scene.  Only built with light
+    // culling (--light-cutoff); otherwise empty.
+    Light_Grid light_grid;
 
-    Render_World() = default;
+    // Whether Prepare has built the above
+    bool prepared = false;
+
+    // Per pixel, what its primary ray hit.  Only kept for anti-aliasing.
+    std::vector<Primary_Id> primary_ids;
+
+    // Hash of everything that decides where primary rays hit: the object
+    // definitions and the contents of their files (Object::content_key),
+    // which objects are shaded, the image size and the camera.  The parser
+    // adds to it; shaders, colors and lights are left out.
+    Cache_Key geometry_key;
+
+    // Hashes of the definition of each shader (by name) and light, and of the
+    // other settings that shade every pixel: the ambient light, shadows, the
+    // recursion depth, the background shader and the shaded objects.  The
+    // parser fills these in; see Parse::definition.
+    std::map<std::string,uint64_t> shader_keys;
+    std::vector<uint64_t> light_keys;
+    Cache_Key settings_key;
+
+    // Per tile, when watching the scene file (-W).
+    std::vector<Tile_Dependencies> tile_dependencies;
+
+    // Per pixel, the first hit, when relighting (-g).  Filled in by
+    // Render_Pixel, or loaded from the cache.
+    std::vector<G_Buffer_Entry> g_buffer;
+
+    // Distinguishes this world from earlier ones in the per thread occluder
+    // caches, which must not use primitives of a world that has been freed.
+    unsigned long long serial;
+
+    // Shadow rays tested with In_Shadow, those that were blocked, and those
+    // blocked by the cached occluder.  Only counted when statistics are
+    // printed (-v).
+    mutable std::atomic<long long> shadow_rays{0};
+    mutable std::atomic<long long> blocked_shadow_rays{0};
+    mutable std::atomic<long long> occluder_cache_hits{0};
+
+    Render_World();
     ~Render_World();
 
     void Render_Pixel(const ivec2& pixel_index);
-    void Render();
+    void Render_Packet(const ivec2& corner);
+    // Prepare the objects (Object::Prepare), and build the acceleration
+    // structure (when enabled) and the light grid (with --light-cutoff).  For
+    // frame sequences, previous is the previous frame, whose objects and
+    // acceleration structure are reused where possible.  Does nothing if
+    // already prepared.
+    void Prepare(Render_World* previous=nullptr);
+    // Prepare and render the image.
+    void Render(Render_World* previous=nullptr);
+    // Render the image in passes of increasing resolution until the time
+    // budget (--time-budget) measured from start runs out.
+    void Render_Progressive(std::chrono::steady_clock::time_point start);
+    // Render the pixels in [begin,end) with the wavefront renderer (-w).  See
+    // wavefront.cpp.
+    void Render_Wavefront(const ivec2& begin,const ivec2& end);
+    // Shade every pixel from its first hit in g_buffer, without tracing the
+    // primary ray.
+    void Relight();
+    // Save or load g_buffer in the cache directory.  Load returns false if
+    // there is no G-buffer for this geometry and camera.
+    void Save_G_Buffer() const;
+    bool Load_G_Buffer();
+    uint64_t G_Buffer_Key() const;
+    // The image is rendered in square tiles, numbered row by row.
+    ivec2 Number_Tiles() const;
+    void Tile_Bounds(int tile,ivec2& begin,ivec2& end) const;
+    // Render the given tiles, after Prepare, and record what each depends on
+    // if tile_dependencies is not empty.
+    void Render_Tiles(const std::vector<int>& tiles);
+    // Bring the image up to date with edited, a new parse of the scene file,
+    // rendering only the tiles that can differ.  This world takes the shaders,
+    // colors and lights of edited but keeps its objects and acceleration
+    // structure.  Returns the number of tiles rendered, or -1 if the geometry
+    // or the settings changed, in which case nothing is done and edited must
+    // be rendered from scratch.
+    int Update(Render_World& edited);
+    // The tiles whose pixels may differ in edited, or false if all may.
+    bool Changed_Tiles(const Render_World& edited,std::vector<int>& tiles) const;
+    // The dependencies being recorded by this thread, if any
+    Tile_Dependencies* Recording() const;
+    // Supersample the pixels on edges (-A), stopping at deadline.
+    void Anti_Alias(std::chrono::steady_clock::time_point deadline);
+    Ray Primary_Ray(const ivec2& pixel_index);
+    Ray Primary_Ray(const vec2& film_point) const;
+
+    // Same as Cast_Ray at recursion depth 1, but also report what was hit,
+    // and if entry is not null, where.
+    vec3 Trace_Primary(const Ray& ray,Primary_Id& id,
+        G_Buffer_Entry* entry=nullptr) const;
 
-    vec3 Cast_Ray(const Ray& ray,int recursion_depth) const;
+    // throughput is the weight of the color seen along ray in the pixel.
+    vec3 Cast_Ray(const Ray& ray,int recursion_depth,double throughput=1) const;
+    vec3 Shade_Hit(const Ray& ray,const Shaded_Object& closest_object,
+        const Hit& closest_hit,int recursion_depth,double throughput=1) const;
+
+    // Return the factor by which to scale the color seen along a secondary
+    // ray whose path has the given throughput, or 0 if the ray should not be
+    // traced (-t and --roulette).
+    double Continuation_Scale(const Ray& ray,double throughput) const;
     std::pair<Shaded_Object,Hit> Closest_Intersection(const Ray& ray) const;
+
+    // Packet version of Closest_Intersection, used for primary rays when
+    // acceleration is enabled.  Only rays whose bits are set in mask are
+    // traced.
+    void Closest_Intersection(const Ray_Packet& packet,int mask,
+        Shaded_Object closest_objects[],Hit closest_hits[]) const;
+
+    // Return whether any object is intersected in the range [small_t,t_max).
+    // Unlike Closest_Intersection, this stops at the first blocker found,
+    // which is stored in occluder if that is not null.
+    bool Any_Intersection(const Ray& ray,double t_max,
+        Occluder* occluder=nullptr) const;
+
+    // Same as Any_Intersection for a shadow ray toward lights[light], but
+    // first tests the primitive that last blocked a shadow ray toward that
+    // light on this thread.  Neighboring points are usually shadowed by the
+    // same primitive, so this mostly avoids the traversal.
+    bool In_Shadow(const Ray& ray,double t_max,int light) const;
+
+    // Print the counters of the occluder cache and the size of the light
+    // grid (-v).
+    void Print_Statistics(std::ostream& out) const;
 };
 #endif
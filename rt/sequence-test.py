@@ -0,0 +1,91 @@
+#!/usr/bin/python
+
+# ./sequence-test.py
+#
+# Checks that frame sequences (-n) render each frame exactly as it renders on
+# its own.  Run it after compiling with scons.  The second frame of each
+# sequence either moves a mesh slightly, so that its hierarchy (-l) is
+# refitted, or scrambles its vertices, so that the refit is rejected and the
+# hierarchy must be built again as a standalone render would build it.
+
+import os,random,shutil,subprocess,sys
+
+dir="sequence-test"
+try:
+    shutil.rmtree(dir)
+except:
+    pass
+os.mkdir(dir)
+shutil.copyfile("ray_tracer",dir+"/ray_tracer")
+shutil.copymode("ray_tracer",dir+"/ray_tracer")
+
+scene='''size 80 60
+color white 1 1 1
+color red .8 .2 .2
+phong_shader rs red red white 50
+mesh B %s
+shaded_object B rs
+point_light L 1 3 3 white 100
+ambient_light white .2
+enable_shadows 1
+recursion_depth_limit 3
+camera 0 0.8 2.5 0 0.6 0 0 1 0 40
+'''
+
+lines=open("bunny.obj").read().split('\n')
+vertices=[l for l in lines if l.startswith('v ')]
+
+def write_mesh(file,new_vertices):
+    out=open(dir+"/"+file,'w')
+    i=0
+    for l in lines:
+        if l.startswith('v '):
+            l=new_vertices[i]
+            i+=1
+        out.write(l+'\n')
+
+moved=[]
+for v in vertices:
+    x,y,z=[float(c) for c in v.split()[1:4]]
+    moved.append('v %.6f %.6f %.6f'%(x,y+0.01,z))
+scrambled=list(vertices)
+random.Random(1).shuffle(scrambled)
+
+write_mesh("frame0.obj",vertices)
+write_mesh("moved.obj",moved)
+write_mesh("scrambled.obj",scrambled)
+
+def render(args):
+    out=subprocess.run(['./ray_tracer','-v','-l']+args,cwd=dir,
+        stdout=subprocess.PIPE,universal_newlines=True).stdout
+    return [l for l in out.split('\n') if l.startswith('mesh ')]
+
+failures=0
+for second,refitted in [("moved.obj",True),("scrambled.obj",False)]:
+    open(dir+"/frame0.txt",'w').write(scene%"frame0.obj")
+    open(dir+"/frame1.txt",'w').write(scene%second)
+    for flags in [["-a","bvh"],["-a","lbvh"],["-a","bvh","-F"]]:
+        name=second+" "+" ".join(flags)
+        sequence=render(flags+['-n','2','-i','frame%d.txt','-o','sequence%d.png'])
+        alone=render(flags+['-i','frame1.txt','-o','alone.png'])
+        same_image=(open(dir+"/sequence1.png",'rb').read()==
+            open(dir+"/alone.png",'rb').read())
+        # The statistics (and so the hierarchy cost) of the second frame must
+        # match the standalone render unless the hierarchy was refitted.
+        ok=same_image and len(sequence)==2 and len(alone)==1
+        if ok and refitted:
+            ok=sequence[1].endswith("(refitted)")
+        elif ok:
+            ok=sequence[1]==alone[0]
+        if not ok:
+            failures+=1
+            print("FAIL: "+name)
+            print("  sequence: "+" | ".join(sequence))
+            print("  alone:    "+" | ".join(alone))
+        else:
+            print("PASS: "+name)
+
+if failures:
+    print("FAIL: %d sequence tests failed"%failures)
+    sys.exit(1)
+print("PASS: all sequence tests")
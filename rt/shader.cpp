@@ -0,0 +1,46 @@
+#include "shader.h"
+#include "ray.h"
+#include "render_world.h"
+
+// The secondary rays of every Shade_Surface call on this thread, and the
+// colors seen along them.  Each call appends its own to the end and removes
+// them when done, so the recursive calls through Cast_Ray nest like a stack
+// and nothing is allocated once the vectors have grown.  Since those calls
+// may reallocate the vectors, entries are only accessed by index.
+static thread_local std::vector<Secondary_Ray> ray_stack;
+static thread_local std::vector<vec3> color_stack;
+
+vec3 Shader::Shade_Surface(const Render_World& render_world,const Ray& ray,
+    const Hit& hit,const vec3& intersection_point,const vec3& normal,
+    int recursion_depth,double throughput) const
+{
+    size_t first_ray=ray_stack.size();
+    Secondary_Rays(render_world,ray,hit,intersection_point,normal,
+        recursion_depth,ray_stack);
+    size_t n=ray_stack.size()-first_ray;
+    size_t first_color=color_stack.size();
+    color_stack.resize(first_color+n);
+    for(size_t i=0;i<n;i++)
+    {
+        Secondary_Ray secondary=ray_stack[first_ray+i];
+        double ray_throughput=throughput*secondary.weight;
+        double scale=render_world.Continuation_Scale(secondary.ray,ray_throughput);
+        if(scale>0)
+        {
+            vec3 color=scale*render_world.Cast_Ray(secondary.ray,
+                recursion_depth+1,ray_throughput*scale);
+            color_stack[first_color+i]=color;
+        }
+    }
+    Shading_Point point;
+    point.ray=ray;
+    point.hit=hit;
+    point.intersection_point=intersection_point;
+    point.normal=normal;
+    point.colors=color_stack.data()+first_color;
+    Shading_Point* points[1]={&point};
+    Combine(render_world,points,1,recursion_depth);
+    ray_stack.resize(first_ray);
+    color_stack.resize(first_color);
+    return point.color;
+}
@@ -2,10 +2,35 @@
 #define __SHADER_H__
 
 #include "vec.h"
+#include "hit.h"
+#include "ray.h"
+#include <vector>
 class Render_World;
-class Ray;
 class Parse;
-struct Hit;
+
+// A surface point to be shaded by Shader::Combine
+struct Shading_Point
+{
+    Ray ray;
+    Hit hit;
+    vec3 intersection_point;
+    vec3 normal;
+    const vec3* colors = nullptr; // colors seen along the secondary rays
+    vec3 color; // the result
+};
+
+// A ray cast by a shader, and the weight with which the color seen along it
+// enters the color of the surface.  The product of the weights along a path
+// is its throughput, which decides whether a ray is worth tracing (-t).
+struct Secondary_Ray
+{
+    Ray ray;
+    double weight = 1;
+};
+
+// Shaders that keep per point state while shading a batch do so in chunks
+// of this many points, so that the state fits on the stack.
+static const int shading_chunk=16;
 
 class Shader
 {
@@ -15,8 +40,27 @@ public:
     Shader() = default;
     virtual ~Shader() = default;
 
-    virtual vec3 Shade_Surface(const Render_World& render_world,const Ray& ray,
+    // Return the color of the surface, tracing any secondary rays (such as
+    // reflections) through Render_World::Cast_Ray at recursion_depth+1.
+    // throughput is the weight of this surface's color in the pixel.
+    vec3 Shade_Surface(const Render_World& render_world,const Ray& ray,
         const Hit& hit,const vec3& intersection_point,const vec3& normal,
-        int recursion_depth) const=0;
+        int recursion_depth,double throughput=1) const;
+
+    // Shading is split in two so that the wavefront renderer (-w) can trace
+    // the secondary rays of many surfaces together.  Secondary_Rays appends
+    // the rays that the shader casts, in order, with the weight that Combine
+    // gives each of their colors.  Combine sets the color of
+    // each of n points given the colors seen along those rays, which it takes
+    // from the point's colors in the same order, advancing colors past them.
+    // Combine shades many points per call, so that the wavefront renderer can
+    // group hits by shader, and shaders can look up material data once per
+    // batch and keep it in cache.
+    virtual void Secondary_Rays(const Render_World& render_world,const Ray& ray,
+        const Hit& hit,const vec3& intersection_point,const vec3& normal,
+        int recursion_depth,std::vector<Secondary_Ray>& rays) const {}
+
+    virtual void Combine(const Render_World& render_world,Shading_Point* const points[],
+        int n,int recursion_depth) const=0;
 };
 #endif
@@ -67,6 +67,40 @@ Hit Sphere::Intersection(const Ray& ray, int part) const
     return hit; // Return a valid or invalid hit
 }
 
+// Same computation as Intersection, carried out for all rays of the packet at
+// once.  The operations are performed in the same order so that the results
+// match exactly.
+void Sphere::Packet_Intersection(const Ray_Packet& packet, int part,
+    int mask, Hit hits[]) const
+{
+    vec3x4 oc = packet.endpoint - Splat(center);
+    double4 a = dot(packet.direction, packet.direction);
+    double4 b = 2.0 * dot(packet.direction, oc);
+    double4 c = dot(oc, oc) - radius * radius;
+
+    double4 discriminant = b * b - 4.0 * a * c;
+    double4 sqrt_discriminant;
+    for (int k = 0; k < packet_size; k++)
+        sqrt_discriminant[k] = sqrt(std::max(discriminant[k], 0.0));
+    double4 t1 = (-b - sqrt_discriminant) / (2.0 * a);
+    double4 t2 = (-b + sqrt_discriminant) / (2.0 * a);
+
+    for (int k = 0; k < packet_size; k++)
+    {
+        if (!(mask & (1 << k))) continue;
+        Hit& hit = hits[k];
+        hit = Hit();
+        hit.triangle = part;
+        if (discriminant[k] < 0) continue;
+        if (t1[k] >= small_t && t2[k] >= small_t)
+            hit.dist = std::min(t1[k], t2[k]);
+        else if (t1[k] >= small_t)
+            hit.dist = t1[k];
+        else if (t2[k] >= small_t)
+            hit.dist = t2[k];
+    }
+}
+
 vec3 Sphere::Normal(const Ray& ray, const Hit& hit) const
 {
     // Ensure hit.dist is valid
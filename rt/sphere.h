@@ -15,6 +15,8 @@ public:
     virtual ~Sphere() = default;
 
     virtual Hit Intersection(const Ray& ray, int part) const override;
+    virtual void Packet_Intersection(const Ray_Packet& packet, int part,
+        int mask, Hit hits[]) const override;
     virtual vec3 Normal(const Ray& ray, const Hit& hit) const override;
     virtual std::pair<Box,bool> Bounding_Box(int part) const override;
 
@@ -3,30 +3,30 @@
 #include "ray.h"
 #include "render_world.h"
 #include <cmath>
-#include <cassert>
+#include <stdexcept>
 
 Transparent_Shader::Transparent_Shader(const Parse* parse, std::istream& in)
 {
     in >> name >> index_of_refraction >> opacity;
     shader = parse->Get_Shader(in);
-    assert(index_of_refraction >= 1.0);
+    if (index_of_refraction < 1.0)
+        throw std::runtime_error("Index of refraction must be at least 1.");
 }
 
-vec3 Transparent_Shader::
-Shade_Surface(const Render_World& render_world, const Ray& ray, const Hit& hit,
-              const vec3& intersection_point, const vec3& normal, int recursion_depth) const
+// The reflected and refracted rays at a surface between air and a material
+// with the given index of refraction, and the fraction of light reflected.
+struct Refraction
 {
-    // Pixel_Print("  call Shade_Surface with location ", Vec_To_String(intersection_point), "; normal: ", Vec_To_String(normal));
-
-    if (recursion_depth > render_world.recursion_depth_limit)
-    {
-        // Pixel_Print("    Recursion depth exceeded. Returning black color.");
-        return vec3(0, 0, 0);
-    }
+    Ray reflected_ray;
+    Ray refracted_ray;
+    bool total_internal_reflection = false;
+    double reflectivity = 0;
+};
 
-    // Compute the base color using the underlying shader
-    vec3 base_color = shader->Shade_Surface(render_world, ray, hit, intersection_point, normal, recursion_depth);
-    // Pixel_Print("    Base color: ", Vec_To_String(base_color));
+static Refraction Refract(const Ray& ray, const vec3& intersection_point,
+    const vec3& normal, double index_of_refraction)
+{
+    Refraction r;
 
     // Determine if the ray is entering or leaving the object
     double n1 = 1.0; // Refractive index of air
@@ -39,10 +39,6 @@ Shade_Surface(const Render_World& render_world, const Ray& ray, const Hit& hit,
         std::swap(n1, n2);
         adjusted_normal = -normal;
     }
-    else
-    {
-        // Pixel_Print("    Ray is entering the object.");
-    }
 
     // Pixel_Print("    n1 (outer): ", n1, ", n2 (inner): ", n2);
     // Pixel_Print("    Adjusted normal: ", Vec_To_String(adjusted_normal));
@@ -56,61 +52,93 @@ Shade_Surface(const Render_World& render_world, const Ray& ray, const Hit& hit,
     // Pixel_Print("    cos_theta_i: ", cos_theta_i);
     // Pixel_Print("    sin^2(theta_t): ", sin2_theta_t);
 
-    vec3 refracted_direction;
-    bool total_internal_reflection = false;
-
     if (sin2_theta_t > 1.0) // Total internal reflection
     {
-        total_internal_reflection = true;
+        r.total_internal_reflection = true;
         // Pixel_Print("    complete internal reflection");
     }
     else
     {
         double cos_theta_t = std::sqrt(1.0 - sin2_theta_t);
-        refracted_direction = n_ratio * ray.direction + (n_ratio * cos_theta_i - cos_theta_t) * adjusted_normal;
+        vec3 refracted_direction = n_ratio * ray.direction + (n_ratio * cos_theta_i - cos_theta_t) * adjusted_normal;
+        r.refracted_ray = Ray(intersection_point - adjusted_normal * small_t, refracted_direction);
         // Pixel_Print("    Refracted direction: ", Vec_To_String(refracted_direction));
     }
 
     // Compute the reflection direction
     vec3 reflected_direction = ray.direction - 2 * dot(ray.direction, adjusted_normal) * adjusted_normal;
+    r.reflected_ray = Ray(intersection_point + adjusted_normal * small_t, reflected_direction);
     // Pixel_Print("    Reflected direction: ", Vec_To_String(reflected_direction));
 
     // Schlick approximation for reflectivity
     double r0 = pow((n1 - n2) / (n1 + n2), 2);
-    double reflectivity = r0 + (1 - r0) * pow(1 - std::abs(cos_theta_i), 5);
-    // Pixel_Print("    Reflectivity (Schlick approximation): ", reflectivity);
-
-    // Cast reflection ray
-    Ray reflected_ray(intersection_point + adjusted_normal * small_t, reflected_direction);
-    // Pixel_Print("    Casting reflection ray.");
-    // Debug_Ray("    Reflected ray", reflected_ray);
-    vec3 reflected_color = render_world.Cast_Ray(reflected_ray, recursion_depth + 1);
-    // Pixel_Print("    Reflected color: ", Vec_To_String(reflected_color));
-
-    // Cast refraction ray if no total internal reflection
-    vec3 refracted_color(0, 0, 0);
-    if (!total_internal_reflection)
+    r.reflectivity = r0 + (1 - r0) * pow(1 - std::abs(cos_theta_i), 5);
+    // Pixel_Print("    Reflectivity (Schlick approximation): ", r.reflectivity);
+    return r;
+}
+
+void Transparent_Shader::
+Secondary_Rays(const Render_World& render_world, const Ray& ray, const Hit& hit,
+               const vec3& intersection_point, const vec3& normal, int recursion_depth,
+               std::vector<Secondary_Ray>& rays) const
+{
+    if (recursion_depth > render_world.recursion_depth_limit) return;
+    Refraction r = Refract(ray, intersection_point, normal, index_of_refraction);
+
+    // The weights are those that Combine mixes the colors with.  On total
+    // internal reflection, the base color is not used.
+    size_t first = rays.size();
+    shader->Secondary_Rays(render_world, ray, hit, intersection_point, normal, recursion_depth, rays);
+    double base_weight = r.total_internal_reflection ? 0 : opacity;
+    for (size_t i = first; i < rays.size(); i++)
+        rays[i].weight *= base_weight;
+    if (r.total_internal_reflection)
+        rays.push_back({r.reflected_ray, 1});
+    else
     {
-        Ray refracted_ray(intersection_point - adjusted_normal * small_t, refracted_direction);
-        // Pixel_Print("    Casting refraction ray.");
-        // Debug_Ray("    Refracted ray", refracted_ray);
-        refracted_color = render_world.Cast_Ray(refracted_ray, recursion_depth + 1);
-        // Pixel_Print("    Refracted color: ", Vec_To_String(refracted_color));
-        vec3 final_color = opacity * base_color + (1 - opacity) * (reflectivity * reflected_color + (1 - reflectivity) * refracted_color);
-        // Pixel_Print("    Object color: ", Vec_To_String(base_color), "; final color: ", Vec_To_String(final_color));
-        return final_color;
+        rays.push_back({r.reflected_ray, (1 - opacity) * r.reflectivity});
+        rays.push_back({r.refracted_ray, (1 - opacity) * (1 - r.reflectivity)});
     }
-    else
+}
+
+void Transparent_Shader::
+Combine(const Render_World& render_world, Shading_Point* const points[], int n,
+        int recursion_depth) const
+{
+    if (recursion_depth > render_world.recursion_depth_limit)
     {
-        vec3 final_color = reflected_color;
-        // Pixel_Print("      ambient: (0 0 0)");
-        // Pixel_Print("      final color (0 0 0)");
-        return final_color;
+        // Pixel_Print("    Recursion depth exceeded. Returning black color.");
+        for (int i = 0; i < n; i++) points[i]->color = vec3(0, 0, 0);
+        return;
     }
 
-    // Combine results using reflectivity, refraction, and opacity
-    vec3 final_color = opacity * base_color + (1 - opacity) * (reflectivity * reflected_color + (1 - reflectivity) * refracted_color);
+    // Compute the base colors using the underlying shader
+    shader->Combine(render_world, points, n, recursion_depth);
 
-    // Pixel_Print("    Object color: ", Vec_To_String(base_color), "; final color: ", Vec_To_String(final_color));
-    return final_color;
+    for (int i = 0; i < n; i++)
+    {
+        Shading_Point& p = *points[i];
+        vec3 base_color = p.color;
+        // Pixel_Print("    Base color: ", Vec_To_String(base_color));
+
+        Refraction r = Refract(p.ray, p.intersection_point, p.normal, index_of_refraction);
+
+        // Color seen along the reflection ray
+        vec3 reflected_color = *p.colors++;
+        // Pixel_Print("    Reflected color: ", Vec_To_String(reflected_color));
+
+        // Color seen along the refraction ray if no total internal reflection
+        if (!r.total_internal_reflection)
+        {
+            vec3 refracted_color = *p.colors++;
+            // Pixel_Print("    Refracted color: ", Vec_To_String(refracted_color));
+            p.color = opacity * base_color + (1 - opacity) * (r.reflectivity * reflected_color + (1 - r.reflectivity) * refracted_color);
+            // Pixel_Print("    Object color: ", Vec_To_String(base_color), "; final color: ", Vec_To_String(p.color));
+        }
+        else
+        {
+            p.color = reflected_color;
+            // Pixel_Print("      final color ", Vec_To_String(p.color));
+        }
+    }
 }
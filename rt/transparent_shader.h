@@ -14,9 +14,11 @@ public:
     Transparent_Shader(const Parse* parse,std::istream& in);
 
     // we assume that any intersection is between this material and air
-    virtual vec3 Shade_Surface(const Render_World& render_world,const Ray& ray,
+    virtual void Secondary_Rays(const Render_World& render_world,const Ray& ray,
         const Hit& hit,const vec3& intersection_point,const vec3& normal,
-        int recursion_depth) const override;
+        int recursion_depth,std::vector<Secondary_Ray>& rays) const override;
+    virtual void Combine(const Render_World& render_world,Shading_Point* const points[],
+        int n,int recursion_depth) const override;
     
     static constexpr const char* parse_name = "transparent_shader";
 };
@@ -32,7 +32,7 @@ struct vec
     {for(int i = 0; i < n; i++) x[i] = (T)v.x[i];}
 
     void make_zero()
-    {fill(0);}
+    {fill(T());}
 
     void fill(T value)
     {for(int i = 0; i < n; i++) x[i] = value;}
@@ -115,7 +115,7 @@ vec<T,n> operator * (const T& c, const vec<T,n>& v)
 template <class T, int n>
 T dot(const vec<T,n> & u, const vec<T,n> & v)
 {
-    T r  =  0;
+    T r  =  T();
     for(int i = 0; i < n; i++) r += u.x[i] * v.x[i];
     return r;
 }
@@ -185,5 +185,7 @@ typedef vec<double,4> vec4;
 typedef vec<int,2> ivec2;
 typedef vec<int,3> ivec3;
 typedef vec<int,4> ivec4;
+typedef vec<float,2> fvec2;
+typedef vec<float,3> fvec3;
 
 #endif
@@ -0,0 +1,253 @@
+#include "render_world.h"
+#include "object.h"
+#include "shader.h"
+#include "ray.h"
+#include "box.h"
+#include <algorithm>
+
+/*
+  Wavefront rendering (the -w commandline option) traces the rays of a region
+  of the image one bounce at a time instead of recursing depth first through
+  Cast_Ray.  Each stage holds the rays of one recursion depth:
+
+  1. The stage is sorted by direction octant and then by the Morton code of
+     the ray origin, so that rays traced one after another start near each
+     other and head the same way, and so touch the same parts of the
+     acceleration structure and the meshes.
+  2. All rays of the stage are traced in that order.
+  3. The hits are shaded in the same order, which only collects the secondary
+     rays of each shader (Shader::Secondary_Rays) into the next stage.
+     Secondary rays with too little throughput (-t) keep their place in the
+     next stage but are not traced, so their color is black.
+
+  Once the last stage is traced, the colors are combined (Shader::Combine)
+  from the deepest stage back to the primary rays, grouping the hits of each
+  stage by shader so that each shader handles all of its hits in one call.
+  Combine does the same arithmetic as Shader::Shade_Surface does with the
+  colors returned by Cast_Ray, so the image is identical to the recursive
+  one.
+*/
+
+// One ray of a wavefront stage
+struct Wavefront_Ray
+{
+    Shading_Point surface; // ray, hit and shading result
+    Shaded_Object object;
+    const Shader* shader = nullptr; // shades the hit, or the background
+    int first_child = 0; // secondary rays in the next stage
+    int children = 0;
+    double throughput = 1; // see Render_World::Continuation_Scale
+    double scale = 1; // of the color seen along the ray; 0 if not traced
+};
+
+// Order the rays of a stage by direction octant, then along a Morton curve
+// through their origins.  Returns (key, index) pairs sorted by key.
+static void Sort_Rays(const std::vector<Wavefront_Ray>& stage,
+    std::vector<std::pair<uint64_t,int>>& order)
+{
+    Box box;
+    box.Make_Empty();
+    for (const auto& w : stage)
+        box.Include_Point(w.surface.ray.endpoint);
+    vec3 extent = box.hi - box.lo;
+
+    order.resize(stage.size());
+    for (size_t r = 0; r < stage.size(); r++)
+    {
+        const Ray& ray = stage[r].surface.ray;
+        uint64_t code = 0;
+        for (int a = 0; a < 3; a++)
+        {
+            double x = extent[a] > 0 ? (ray.endpoint[a] - box.lo[a]) / extent[a] : 0;
+            uint64_t q = std::min(1023.0, x * 1024);
+            code |= Spread_Bits(q) << (2 - a);
+            if (ray.direction[a] < 0) code |= 1ull << (30 + a);
+        }
+        order[r] = {code, (int)r};
+    }
+    std::sort(order.begin(), order.end());
+}
+
+// Group the rays of a stage that have a shader by that shader.  The rays
+// shaded by shaders[g] are grouped[group_start[g]] to
+// grouped[group_start[g+1]-1], in stage order.  There are few distinct
+// shaders, so they are found by a linear search.
+static void Group_By_Shader(const std::vector<Wavefront_Ray>& stage,
+    std::vector<const Shader*>& shaders, std::vector<int>& group_start,
+    std::vector<int>& grouped)
+{
+    shaders.clear();
+    group_start.clear();
+    size_t last = 0;
+    for (const auto& w : stage)
+    {
+        if (!w.shader) continue;
+        if (last >= shaders.size() || shaders[last] != w.shader)
+        {
+            last = std::find(shaders.begin(), shaders.end(), w.shader) - shaders.begin();
+            if (last == shaders.size())
+            {
+                shaders.push_back(w.shader);
+                group_start.push_back(0);
+            }
+        }
+        group_start[last]++;
+    }
+
+    // Counts to starting offsets
+    int total = 0;
+    for (auto& start : group_start)
+    {
+        int count = start;
+        start = total;
+        total += count;
+    }
+    group_start.push_back(total);
+
+    grouped.resize(total);
+    std::vector<int> next(group_start.begin(), group_start.end() - 1);
+    last = 0;
+    for (int r = 0; r < (int)stage.size(); r++)
+    {
+        const Shader* shader = stage[r].shader;
+        if (!shader) continue;
+        if (shaders[last] != shader)
+            last = std::find(shaders.begin(), shaders.end(), shader) - shaders.begin();
+        grouped[next[last]++] = r;
+    }
+}
+
+// Buffers kept by each thread between calls to Render_Wavefront, so that
+// their memory is reused rather than allocated and faulted in for every
+// region.
+struct Wavefront_Scratch
+{
+    std::vector<std::vector<Wavefront_Ray>> stages;
+    std::vector<std::pair<uint64_t,int>> order;
+    std::vector<Secondary_Ray> rays;
+    std::vector<std::vector<vec3>> colors; // per stage
+    std::vector<const Shader*> shaders; // distinct shaders of a stage
+    std::vector<int> group_start; // per shader, into grouped
+    std::vector<int> grouped; // stage indices grouped by shader
+    std::vector<Shading_Point*> points; // of one group
+};
+static thread_local Wavefront_Scratch scratch;
+
+void Render_World::Render_Wavefront(const ivec2& begin, const ivec2& end)
+{
+    auto& stages = scratch.stages;
+    auto& order = scratch.order;
+    auto& rays = scratch.rays;
+    auto& colors = scratch.colors;
+    auto& shaders = scratch.shaders;
+    auto& group_start = scratch.group_start;
+    auto& grouped = scratch.grouped;
+    auto& points = scratch.points;
+
+    // Returns stages[d], emptied
+    auto stage = [&stages](int d) -> std::vector<Wavefront_Ray>&
+    {
+        if (d >= (int)stages.size()) stages.resize(d + 1);
+        stages[d].clear();
+        return stages[d];
+    };
+
+    std::vector<Wavefront_Ray>& primary = stage(0);
+    for (int j = begin[1]; j < end[1]; j++)
+        for (int i = begin[0]; i < end[0]; i++)
+        {
+            primary.emplace_back();
+            primary.back().surface.ray = Primary_Ray(ivec2(i, j));
+        }
+
+    // Trace and shade the rays of recursion depth d in stages[d-1].  Deeper
+    // rays are black, as in Cast_Ray.
+    int traced = 0;
+    for (int depth = 1; depth <= recursion_depth_limit && !stages[depth - 1].empty(); depth++)
+    {
+        std::vector<Wavefront_Ray>& next = stage(depth);
+        std::vector<Wavefront_Ray>& current = stages[depth - 1];
+        Sort_Rays(current, order);
+        for (const auto& o : order)
+        {
+            if (current[o.second].scale == 0) continue;
+            Shading_Point& p = current[o.second].surface;
+            std::tie(current[o.second].object, p.hit) = Closest_Intersection(p.ray);
+        }
+
+        for (const auto& o : order)
+        {
+            Wavefront_Ray& w = current[o.second];
+            if (w.scale == 0) continue;
+            Shading_Point& p = w.surface;
+            if (w.object.object)
+            {
+                p.intersection_point = p.ray.Point(p.hit.dist);
+                p.normal = w.object.object->Normal(p.ray, p.hit);
+                w.shader = w.object.shader;
+            }
+            else
+            {
+                p.hit = Hit();
+                w.shader = background_shader;
+            }
+            if (!w.shader) continue;
+
+            rays.clear();
+            w.shader->Secondary_Rays(*this, p.ray, p.hit, p.intersection_point,
+                p.normal, depth, rays);
+            w.first_child = next.size();
+            w.children = rays.size();
+            for (const auto& ray : rays)
+            {
+                next.emplace_back();
+                Wavefront_Ray& child = next.back();
+                child.surface.ray = ray.ray;
+                child.throughput = w.throughput * ray.weight;
+                child.scale = Continuation_Scale(ray.ray, child.throughput);
+                child.throughput *= child.scale;
+            }
+        }
+        traced = depth;
+    }
+
+    // Combine colors, deepest traced stage first.  The last stage was not
+    // traced, so its colors are black.  The hits of each stage are grouped by
+    // shader, and each shader shades all of its hits in one call.
+    if ((int)colors.size() <= traced) colors.resize(traced + 1);
+    colors[traced].assign(stages[traced].size(), vec3(0, 0, 0));
+    for (int d = traced - 1; d >= 0; d--)
+    {
+        std::vector<Wavefront_Ray>& current = stages[d];
+        colors[d].assign(current.size(), vec3(0, 0, 0));
+        Group_By_Shader(current, shaders, group_start, grouped);
+
+        for (size_t g = 0; g < shaders.size(); g++)
+        {
+            points.clear();
+            for (int k = group_start[g]; k < group_start[g + 1]; k++)
+            {
+                Wavefront_Ray& w = current[grouped[k]];
+                w.surface.colors = colors[d + 1].data() + w.first_child;
+                points.push_back(&w.surface);
+            }
+            shaders[g]->Combine(*this, points.data(), points.size(), d + 1);
+            for (int k = group_start[g]; k < group_start[g + 1]; k++)
+            {
+                const Wavefront_Ray& w = current[grouped[k]];
+                colors[d][grouped[k]] = w.scale * w.surface.color;
+            }
+        }
+    }
+
+    int r = 0;
+    for (int j = begin[1]; j < end[1]; j++)
+        for (int i = begin[0]; i < end[0]; i++, r++)
+        {
+            const Wavefront_Ray& w = stages[0][r];
+            camera.Set_Pixel(ivec2(i, j), Pixel_Color(colors[0][r]));
+            if (!primary_ids.empty())
+                primary_ids[j * camera.number_pixels[0] + i] =
+                    {w.object.object, w.object.shader, w.surface.hit.triangle};
+        }
+}